@@ -82,6 +82,8 @@ const char *Args::Param(const char *token)
 
 /**
  * Scan for a match
+ * A short option (-x) may be followed directly by its value, a long option
+ * (--xyz) only by '=' and the value, so --id does not match --id-file.
  *
  * @param token   The token string to match
  * @return        NULL or the pointer to the string
@@ -98,13 +100,15 @@ const char *Args::Params(const char *token, int& index)
    }
 
    token_len = (int)strlen(token);
+   bool is_long = (token_len > 2) && (token[0] == '-') && (token[1] == '-');
 
    for (idx = index; idx < m_count; idx++)
    {
       arg_len = (int)strlen(m_values[idx]);
 
       if ((arg_len >= token_len) &&
-          (memcmp(token, m_values[idx], token_len) == 0))
+          (memcmp(token, m_values[idx], token_len) == 0) &&
+          (!is_long || (arg_len == token_len) || (m_values[idx][token_len] == '=')))
       {
          SetUsed(idx);
          if (arg_len > token_len)
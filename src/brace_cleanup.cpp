@@ -31,6 +31,8 @@ static bool close_statement(fp_data& fpd, bool& consumed, struct parse_frame *fr
 static bool check_complex_statements(fp_data& fpd, bool& consumed, struct parse_frame *frm, chunk_t *pc);
 static bool handle_complex_close(fp_data& fpd, bool& consumed, struct parse_frame *frm, chunk_t *pc);
 
+static void skip_function_bodies(fp_data& fpd);
+
 
 static int preproc_start(fp_data& fpd, struct parse_frame *frm, chunk_t *pc, c_token_t& in_preproc)
 {
@@ -164,6 +166,11 @@ void brace_cleanup(fp_data& fpd)
       }
       pc = chunk_get_next(pc);
    }
+
+   if (fpd.mode == PM_DECLS_ONLY)
+   {
+      skip_function_bodies(fpd);
+   }
 }
 
 
@@ -1035,3 +1042,157 @@ static bool close_statement(fp_data& fpd, bool& consumed, struct parse_frame *fr
    }
    return(false);
 }
+
+
+/**
+ * Checks if a brace open starts a function body, ie. it follows the close
+ * paren of a word + paren sequence: "name(...) {"
+ *
+ * Trailing qualifiers, exception specs, a trailing return type and a
+ * constructor initializer list may sit between the paren and the brace:
+ * "name(...) const noexcept -> T {" or "name(...) : a(1), b{2} {".
+ */
+static bool is_function_body_open(chunk_t *pc)
+{
+   chunk_t *prev;
+   chunk_t *open;
+   int     angle_depth = 0;
+
+   if ((pc->type != CT_BRACE_OPEN) ||
+       (pc->parent_type != CT_NONE) ||
+       (pc->flags & PCF_IN_PREPROC))
+   {
+      return(false);
+   }
+
+   prev = chunk_get_prev_nnl(pc, CNAV_PREPROC);
+   while (prev != NULL)
+   {
+      switch (prev->type)
+      {
+      case CT_PAREN_CLOSE:
+         open = chunk_skip_to_match_rev(prev, CNAV_PREPROC);
+         prev = chunk_get_prev_nnl(open, CNAV_PREPROC);
+         if (prev == NULL)
+         {
+            return(false);
+         }
+         if ((angle_depth == 0) &&
+             ((prev->type == CT_WORD) || (prev->type == CT_TYPE)))
+         {
+            return(true);
+         }
+         /* "throw(...)", "decltype(...)" or a template argument */
+         if ((angle_depth == 0) &&
+             (prev->type != CT_THROW) && (prev->type != CT_SIZEOF))
+         {
+            return(false);
+         }
+         continue;
+
+      case CT_BRACE_CLOSE:
+         /* a braced member initializer: "b{2}" */
+         open = chunk_skip_to_match_rev(prev, CNAV_PREPROC);
+         prev = chunk_get_prev_nnl(open, CNAV_PREPROC);
+         if ((prev == NULL) ||
+             ((prev->type != CT_WORD) && (prev->type != CT_TYPE)))
+         {
+            return(false);
+         }
+         continue;
+
+      case CT_ANGLE_CLOSE:
+         angle_depth++;
+         break;
+
+      case CT_ANGLE_OPEN:
+         if (angle_depth == 0)
+         {
+            return(false);
+         }
+         angle_depth--;
+         break;
+
+      case CT_QUALIFIER:
+      case CT_WORD:
+      case CT_TYPE:
+      case CT_THROW:
+      case CT_SIZEOF:
+      case CT_DC_MEMBER:
+      case CT_MEMBER:
+      case CT_STAR:
+      case CT_AMP:
+      case CT_BOOL:
+      case CT_COMMA:
+      case CT_COLON:
+         break;
+
+      default:
+         return(false);
+      }
+      prev = chunk_get_prev_nnl(prev, CNAV_PREPROC);
+   }
+   return(false);
+}
+
+
+/**
+ * Removes the contents of function bodies, leaving only the braces and any
+ * preprocessor directives within them. Used for declaration-only parsing, so
+ * the later passes step over each body in one go instead of classifying
+ * every token in it.
+ *
+ * A body is left alone if another brace open at the same level is found
+ * before the matching close, as happens when the function head is
+ * duplicated in #if/#else branches.
+ */
+static void skip_function_bodies(fp_data& fpd)
+{
+   chunk_t *pc;
+   chunk_t *close;
+   chunk_t *next;
+
+   for (pc = chunk_get_head(fpd); pc != NULL; pc = chunk_get_next(pc))
+   {
+      if (!is_function_body_open(pc))
+      {
+         continue;
+      }
+
+      for (close = chunk_get_next(pc, CNAV_PREPROC);
+           close != NULL;
+           close = chunk_get_next(close, CNAV_PREPROC))
+      {
+         if (close->level == pc->level)
+         {
+            break;
+         }
+      }
+
+      if ((close == NULL) || (close->type != CT_BRACE_CLOSE))
+      {
+         continue;
+      }
+
+      LOG_FMT(LBRDEL, "%s:%d] skipping function body up to line %d\n",
+              __func__, pc->orig_line, close->orig_line);
+
+      for (next = chunk_get_next(pc); next != close; next = chunk_get_next(next))
+      {
+         /* Keep preprocessor lines, including the newlines around them */
+         if ((next->flags & PCF_IN_PREPROC) ||
+             (chunk_is_newline(next) &&
+              (((next->prev->flags & PCF_IN_PREPROC) != 0) ||
+               ((next->next->flags & PCF_IN_PREPROC) != 0))))
+         {
+            continue;
+         }
+
+         chunk_t *tmp = next->prev;
+         chunk_del(fpd, next);
+         next = tmp;
+      }
+
+      pc = close;
+   }
+}
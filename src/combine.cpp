@@ -1028,6 +1028,10 @@ void fix_symbols(fp_data& fpd)
    }
    while (pc != NULL)
    {
+      if (parse_time_exceeded(fpd))
+      {
+         return;
+      }
       prev = chunk_get_prev_nnl(pc, CNAV_PREPROC);
       if (prev == NULL)
       {
@@ -1052,6 +1056,11 @@ void fix_symbols(fp_data& fpd)
    int square_level = -1;
    while (pc != NULL)
    {
+      if (parse_time_exceeded(fpd))
+      {
+         return;
+      }
+
       /* Can't have a variable definition inside [ ] */
       if (square_level < 0)
       {
@@ -3147,6 +3156,11 @@ static void mark_function(fp_data& fpd, chunk_t *pc)
    tmp = paren_close;
    while ((tmp = chunk_get_next_nnl(tmp)) != NULL)
    {
+      if (parse_time_exceeded(fpd))
+      {
+         return;
+      }
+
       /* Only care about brace or semi on the same level */
       if (tmp->level < pc->level)
       {
@@ -0,0 +1,475 @@
+/**
+ * @file crawl.cpp
+ * Finds the source files below a set of directories.
+ *
+ * The directories are read by a pool of threads, and the files found are
+ * queued so they can be analyzed while the crawl is still running.
+ * Files and directories matching the exclude patterns or the patterns in
+ * .gitignore files are skipped.
+ *
+ * @author  Thomas Thorsen
+ * @license GPL v2+
+ */
+#include "toks_types.h"
+#include "prototypes.h"
+#include "sqlite3080200.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+/* An exclude pattern, with the directory it is relative to */
+struct ignore_rule
+{
+   string base;
+   string pattern;
+   bool   dir_only;
+   bool   anchored;
+   bool   negate;
+};
+
+typedef vector<ignore_rule> ignore_rules;
+
+struct crawl_item
+{
+   string                         path;
+   std::shared_ptr<ignore_rules>  rules;
+};
+
+struct crawl_entry
+{
+   string name;
+   bool   is_dir;
+};
+
+struct crawl_state
+{
+   deque<crawl_item> dirs;
+   deque<string>     files;
+   int               busy;      /* threads reading a directory */
+   bool              done;
+#ifndef WIN32
+   pthread_mutex_t   lock;
+   pthread_cond_t    dirs_cond;
+   pthread_cond_t    files_cond;
+   vector<pthread_t> threads;
+#endif
+};
+
+static crawl_state crawl;
+
+
+static string join_path(const string& dir, const char *name)
+{
+   if (!dir.empty() && (dir[dir.size() - 1] == '/'))
+   {
+      return dir + name;
+   }
+   return dir + "/" + name;
+}
+
+/**
+ * Parses a .gitignore style pattern. Returns false for blank lines and
+ * comments.
+ */
+static bool parse_rule(const string& base, string pattern, ignore_rule& rule)
+{
+   while (!pattern.empty() && isspace((unsigned char) pattern[pattern.size() - 1]))
+   {
+      pattern.erase(pattern.size() - 1);
+   }
+   if (pattern.empty() || (pattern[0] == '#'))
+   {
+      return false;
+   }
+
+   rule.base = base;
+   rule.negate = (pattern[0] == '!');
+   if (rule.negate)
+   {
+      pattern.erase(0, 1);
+   }
+   rule.dir_only = (pattern[pattern.size() - 1] == '/');
+   if (rule.dir_only)
+   {
+      pattern.erase(pattern.size() - 1);
+   }
+   if (pattern.compare(0, 3, "**/") == 0)
+   {
+      pattern.erase(0, 3);
+   }
+   /* A pattern with a slash is relative to the directory of the rule */
+   rule.anchored = (pattern.find('/') != string::npos);
+   if (!pattern.empty() && (pattern[0] == '/'))
+   {
+      pattern.erase(0, 1);
+   }
+   rule.pattern = pattern;
+
+   return !pattern.empty();
+}
+
+/* Adds the rules of a .gitignore file in dir, if there is one */
+static std::shared_ptr<ignore_rules> load_gitignore(
+   const string& dir, const std::shared_ptr<ignore_rules>& parent)
+{
+   string filename = join_path(dir, ".gitignore");
+   FILE *p_file = fopen(filename.c_str(), "r");
+   std::shared_ptr<ignore_rules> rules = parent;
+   string line;
+
+   if (p_file == NULL)
+   {
+      return rules;
+   }
+
+   while (read_list_item(p_file, line, '\n'))
+   {
+      ignore_rule rule;
+
+      if (parse_rule(dir, line, rule))
+      {
+         if (rules == parent)
+         {
+            rules = std::make_shared<ignore_rules>(*parent);
+         }
+         rules->push_back(rule);
+      }
+   }
+   fclose(p_file);
+
+   return rules;
+}
+
+/* The last matching rule decides, like in git */
+static bool is_ignored(const ignore_rules& rules, const string& path,
+                       const char *name, bool is_dir)
+{
+   bool ignored = false;
+
+   for (size_t i = 0; i < rules.size(); i++)
+   {
+      const ignore_rule& rule = rules[i];
+      const char *subject = name;
+
+      if (rule.dir_only && !is_dir)
+      {
+         continue;
+      }
+      if (rule.anchored)
+      {
+         if ((path.size() <= rule.base.size()) ||
+             (path.compare(0, rule.base.size(), rule.base) != 0))
+         {
+            continue;
+         }
+         subject = path.c_str() + rule.base.size();
+         while (*subject == '/')
+         {
+            subject++;
+         }
+      }
+      if (sqlite3_strglob(rule.pattern.c_str(), subject) == 0)
+      {
+         ignored = !rule.negate;
+      }
+   }
+   return ignored;
+}
+
+/* Lists the entries of a directory */
+static bool list_dir(const string& path, vector<crawl_entry>& entries)
+{
+#ifdef __linux__
+   struct linux_dirent64
+   {
+      UINT64         d_ino;
+      int64_t        d_off;
+      unsigned short d_reclen;
+      unsigned char  d_type;
+      char           d_name[1];
+   };
+   char buf[32 * 1024] __attribute__ ((aligned(8)));
+   int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   long len;
+
+   if (fd < 0)
+   {
+      LOG_FMT(LWARN, "%s: open(%s) failed: %s (%d)\n",
+              __func__, path.c_str(), strerror(errno), errno);
+      return false;
+   }
+
+   while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+   {
+      for (long pos = 0; pos < len; )
+      {
+         const linux_dirent64 *ent = (const linux_dirent64 *) (buf + pos);
+         unsigned char type = ent->d_type;
+
+         pos += ent->d_reclen;
+
+         if (type == DT_UNKNOWN)
+         {
+            struct stat st;
+            if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+               continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+         }
+         /* Symbolic links are not followed */
+         if ((type == DT_DIR) || (type == DT_REG))
+         {
+            crawl_entry entry = { ent->d_name, type == DT_DIR };
+            entries.push_back(entry);
+         }
+      }
+   }
+   close(fd);
+#else
+   DIR *p_dir = opendir(path.c_str());
+   struct dirent *ent;
+
+   if (p_dir == NULL)
+   {
+      LOG_FMT(LWARN, "%s: opendir(%s) failed: %s (%d)\n",
+              __func__, path.c_str(), strerror(errno), errno);
+      return false;
+   }
+
+   while ((ent = readdir(p_dir)) != NULL)
+   {
+      struct stat st;
+      string name = join_path(path, ent->d_name);
+
+      if ((stat(name.c_str(), &st) == 0) &&
+          (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+      {
+         crawl_entry entry = { ent->d_name, S_ISDIR(st.st_mode) };
+         entries.push_back(entry);
+      }
+   }
+   closedir(p_dir);
+#endif
+   return true;
+}
+
+/* Reads a directory, the results are added to dirs and files */
+static void crawl_dir(const crawl_item& item, deque<crawl_item>& dirs,
+                      deque<string>& files)
+{
+   vector<crawl_entry> entries;
+   std::shared_ptr<ignore_rules> rules = load_gitignore(item.path, item.rules);
+
+   (void) list_dir(item.path, entries);
+
+   for (size_t i = 0; i < entries.size(); i++)
+   {
+      const char *name = entries[i].name.c_str();
+      string path;
+
+      if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) ||
+          (entries[i].is_dir && (strcmp(name, ".git") == 0)))
+      {
+         continue;
+      }
+      if (!entries[i].is_dir && !is_source_filename(name))
+      {
+         continue;
+      }
+
+      path = join_path(item.path, name);
+      if (is_ignored(*rules, path, name, entries[i].is_dir))
+      {
+         LOG_FMT(LFILELIST, "Excluded %s\n", path.c_str());
+         continue;
+      }
+
+      if (entries[i].is_dir)
+      {
+         crawl_item sub = { path, rules };
+         dirs.push_back(sub);
+      }
+      else
+      {
+         files.push_back(path);
+      }
+   }
+}
+
+#ifndef WIN32
+static void *crawl_thread(void *arg)
+{
+   pthread_mutex_lock(&crawl.lock);
+   for (;;)
+   {
+      deque<crawl_item> dirs;
+      deque<string> files;
+
+      while (crawl.dirs.empty() && (crawl.busy > 0))
+      {
+         pthread_cond_wait(&crawl.dirs_cond, &crawl.lock);
+      }
+      if (crawl.dirs.empty())
+      {
+         break;
+      }
+
+      crawl_item item = crawl.dirs.front();
+      crawl.dirs.pop_front();
+      crawl.busy++;
+      pthread_mutex_unlock(&crawl.lock);
+
+      crawl_dir(item, dirs, files);
+
+      pthread_mutex_lock(&crawl.lock);
+      crawl.busy--;
+      if (!files.empty())
+      {
+         crawl.files.insert(crawl.files.end(), files.begin(), files.end());
+         pthread_cond_signal(&crawl.files_cond);
+      }
+      crawl.dirs.insert(crawl.dirs.end(), dirs.begin(), dirs.end());
+      pthread_cond_broadcast(&crawl.dirs_cond);
+   }
+
+   /* No directories left and no thread that could add more */
+   crawl.done = true;
+   pthread_cond_broadcast(&crawl.dirs_cond);
+   pthread_cond_broadcast(&crawl.files_cond);
+   pthread_mutex_unlock(&crawl.lock);
+
+   return NULL;
+}
+#endif
+
+
+/**
+ * Starts crawling the directories for source files, use crawl_next() to
+ * get the files found.
+ *
+ * @param roots     The directories to crawl
+ * @param excludes  Exclude patterns in .gitignore syntax
+ * @param threads   The number of threads reading directories
+ */
+void crawl_start(const deque<string>& roots, const deque<string>& excludes, int threads)
+{
+   crawl.busy = 0;
+   crawl.done = false;
+
+   for (size_t i = 0; i < roots.size(); i++)
+   {
+      std::shared_ptr<ignore_rules> rules = std::make_shared<ignore_rules>();
+
+      for (size_t j = 0; j < excludes.size(); j++)
+      {
+         ignore_rule rule;
+
+         if (parse_rule(roots[i], excludes[j], rule))
+         {
+            rules->push_back(rule);
+         }
+      }
+
+      crawl_item item = { roots[i], rules };
+      crawl.dirs.push_back(item);
+   }
+
+#ifndef WIN32
+   pthread_mutex_init(&crawl.lock, NULL);
+   pthread_cond_init(&crawl.dirs_cond, NULL);
+   pthread_cond_init(&crawl.files_cond, NULL);
+
+   for (int i = 0; i < ((threads > 0) ? threads : 1); i++)
+   {
+      pthread_t thread;
+
+      if (pthread_create(&thread, NULL, crawl_thread, NULL) == 0)
+      {
+         crawl.threads.push_back(thread);
+      }
+   }
+   if (!crawl.threads.empty())
+   {
+      return;
+   }
+#endif
+
+   /* Crawl everything up front without threads */
+   while (!crawl.dirs.empty())
+   {
+      crawl_item item = crawl.dirs.front();
+      crawl.dirs.pop_front();
+      crawl_dir(item, crawl.dirs, crawl.files);
+   }
+   crawl.done = true;
+}
+
+/**
+ * Gets the next file found by the crawl, waiting for one if needed.
+ * Returns false when the crawl is complete and all files have been taken.
+ */
+bool crawl_next(string& filename)
+{
+   bool retval = false;
+
+#ifndef WIN32
+   if (!crawl.threads.empty())
+   {
+      pthread_mutex_lock(&crawl.lock);
+      while (crawl.files.empty() && !crawl.done)
+      {
+         pthread_cond_wait(&crawl.files_cond, &crawl.lock);
+      }
+   }
+#endif
+
+   if (!crawl.files.empty())
+   {
+      filename = crawl.files.front();
+      crawl.files.pop_front();
+      retval = true;
+   }
+
+#ifndef WIN32
+   if (!crawl.threads.empty())
+   {
+      pthread_mutex_unlock(&crawl.lock);
+   }
+#endif
+
+   return retval;
+}
+
+/* Waits for the crawler threads, after crawl_next() returned false */
+void crawl_finish(void)
+{
+#ifndef WIN32
+   for (size_t i = 0; i < crawl.threads.size(); i++)
+   {
+      pthread_join(crawl.threads[i], NULL);
+   }
+   if (!crawl.threads.empty())
+   {
+      crawl.threads.clear();
+      pthread_cond_destroy(&crawl.files_cond);
+      pthread_cond_destroy(&crawl.dirs_cond);
+      pthread_mutex_destroy(&crawl.lock);
+   }
+#endif
+}
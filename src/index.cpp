@@ -1,16 +1,39 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <cinttypes>
+#include <cerrno>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifndef WIN32
+#include <pthread.h>
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
 
 #include "prototypes.h"
 #include "toks_types.h"
 #include "sqlite3080200.h"
 
-#define INDEX_VERSION 1
+#define INDEX_VERSION 10
+
+/* The page size of a new index with --autotune, larger pages make the
+ * B-trees of the entry tables and their indexes shallower */
+#define AUTOTUNE_PAGE_SIZE   16384
+
+/* The page cache with --autotune when the size of the index is not known */
+#define AUTOTUNE_NEW_CACHE   (256 * 1024 * 1024)
+
+/* The pages in the WAL before it is checkpointed in the middle of a group
+ * of files, see index_checkpoint() */
+#define WAL_AUTOCHECKPOINT 16384
+
+/* The files committed in one transaction with WAL, outside of a batch */
+#define WAL_GROUP_FILES    64
 
 #define xstr(a) str(a)
 #define str(a) #a
@@ -26,6 +49,66 @@ static int index_version_check_callback(
    return 0;
 }
 
+static int index_ref_types_callback(
+   void *ref_types,
+   int argc,
+   char **argv,
+   char **azColName)
+{
+   if ((argc == 2) && (argv[0] != NULL) && (argv[1] != NULL))
+   {
+      ((UINT32 *) ref_types)[0] = (UINT32) strtoul(argv[0], NULL, 10);
+      ((UINT32 *) ref_types)[1] = (UINT32) strtoul(argv[1], NULL, 10);
+   }
+   return 0;
+}
+
+/* The reference types are fixed when the index is created */
+static bool index_check_ref_types(void)
+{
+   int result;
+   UINT32 ref_types[2] = { cpd.ref_types, cpd.func_ref_types };
+   bool retval = true;
+
+   result = sqlite3_exec(
+     cpd.db->index,
+     "SELECT RefTypes,FuncRefTypes FROM Version",
+     index_ref_types_callback,
+     ref_types,
+     NULL);
+
+   if (result != SQLITE_OK)
+   {
+      LOG_FMT(LERR, "index_check_ref_types: access error (%d)\n", result);
+      retval = false;
+   }
+   else if (cpd.ref_types_set &&
+            ((ref_types[0] != cpd.ref_types) ||
+             (ref_types[1] != cpd.func_ref_types)))
+   {
+      LOG_FMT(LERR, "Index was built with different reference types, delete it to continue\n");
+      retval = false;
+   }
+   else
+   {
+      cpd.ref_types = ref_types[0];
+      cpd.func_ref_types = ref_types[1];
+   }
+
+   return retval;
+}
+
+static int index_journal_mode_callback(
+   void *wal,
+   int argc,
+   char **argv,
+   char **azColName)
+{
+   if ((argc == 1) && (argv[0] != NULL))
+      *((bool *) wal) = (strcmp(argv[0], "wal") == 0);
+   return 0;
+}
+
 static bool index_check(void)
 {
    int result;
@@ -33,7 +116,7 @@ static bool index_check(void)
    bool retval = true;
 
    result = sqlite3_exec(
-     cpd.index,
+     cpd.db->index,
      "SELECT Version FROM Version",
      index_version_check_callback,
      &version,
@@ -46,23 +129,47 @@ static bool index_check(void)
          LOG_FMT(LERR, "Wrong index format version, delete it to continue\n");
          retval = false;
       }
+      else
+      {
+         retval = index_check_ref_types();
+      }
    }
    else
    {
       char *errmsg = NULL;
-
-      result = sqlite3_exec(
-         cpd.index,
-         "CREATE TABLE Version(Version INTEGER);"
-         "INSERT INTO Version VALUES(" xstr(INDEX_VERSION) ");"
-         "CREATE TABLE Files(Digest TEXT, Filename TEXT UNIQUE);"
+      char *sql = sqlite3_mprintf(
+         "CREATE TABLE Version(Version INTEGER, RefTypes INTEGER, FuncRefTypes INTEGER, Storage TEXT);"
+         "INSERT INTO Version VALUES(" xstr(INDEX_VERSION) ",%u,%u,NULL);"
+         "CREATE TABLE Files(Digest TEXT, Filename TEXT UNIQUE, Mode INTEGER, Degraded INTEGER, Indexed INTEGER, Lang INTEGER, MaxTokens INTEGER, MaxParseTime INTEGER);"
+         "CREATE INDEX FilesDigest ON Files(Digest, Lang);"
+         "CREATE TABLE Cached(Digest TEXT, Lang INTEGER, Mode INTEGER, Degraded INTEGER, Cached INTEGER);"
+         "CREATE INDEX CachedDigest ON Cached(Digest, Lang);"
          "CREATE TABLE Refs(Filerow INTEGER, Line INTEGER, ColumnStart INTEGER, Scope TEXT, Type INTEGER, Identifier TEXT);"
          "CREATE TABLE Defs(Filerow INTEGER, Line INTEGER, ColumnStart INTEGER, Scope TEXT, Type INTEGER, Identifier TEXT);"
          "CREATE TABLE Decls(Filerow INTEGER, Line INTEGER, ColumnStart INTEGER, Scope TEXT, Type INTEGER, Identifier TEXT);",
+         cpd.ref_types,
+         cpd.func_ref_types);
+
+      /* The page size and auto_vacuum can only be set before the first
+       * table is created. Free pages are reclaimed by index_maintain(). */
+      if (cpd.storage.page_size > 0)
+      {
+         char pragma[64];
+
+         snprintf(pragma, sizeof(pragma), "PRAGMA page_size=%d", cpd.storage.page_size);
+         (void) sqlite3_exec(cpd.db->index, pragma, NULL, NULL, NULL);
+      }
+      (void) sqlite3_exec(cpd.db->index, "PRAGMA auto_vacuum=INCREMENTAL", NULL, NULL, NULL);
+
+      result = sqlite3_exec(
+         cpd.db->index,
+         sql,
          NULL,
          NULL,
          &errmsg);
 
+      sqlite3_free(sql);
+
       if (result != SQLITE_OK)
       {
          LOG_FMT(LERR, "index_check: access error (%d: %s)\n", result, errmsg != NULL ? errmsg : "");
@@ -72,647 +179,3878 @@ static bool index_check(void)
       sqlite3_free(errmsg);
    }
 
+   /* WAL is kept once enabled, as it is recorded in the index file */
    (void) sqlite3_exec(
-      cpd.index,
-      "PRAGMA journal_mode=OFF;"
-      "PRAGMA synchronous=OFF;"
-      "PRAGMA case_sensitive_like=ON;",
-      NULL,
-      NULL,
+      cpd.db->index,
+      "PRAGMA journal_mode",
+      index_journal_mode_callback,
+      &cpd.db->wal,
       NULL);
 
+   if (cpd.wal || cpd.db->wal)
+   {
+      cpd.db->wal = true;
+      (void) sqlite3_exec(
+         cpd.db->index,
+         "PRAGMA journal_mode=WAL;"
+         "PRAGMA synchronous=NORMAL;"
+         "PRAGMA wal_autocheckpoint=" xstr(WAL_AUTOCHECKPOINT) ";"
+         "PRAGMA case_sensitive_like=ON;",
+         NULL,
+         NULL,
+         NULL);
+   }
+   else
+   {
+      (void) sqlite3_exec(
+         cpd.db->index,
+         "PRAGMA journal_mode=OFF;"
+         "PRAGMA synchronous=OFF;"
+         "PRAGMA case_sensitive_like=ON;",
+         NULL,
+         NULL,
+         NULL);
+   }
+
    return retval;
 }
 
-bool index_open(const char *index_file, bool create)
+static int index_storage_callback(
+   void *storage,
+   int argc,
+   char **argv,
+   char **azColName)
 {
-   int result, open_flags = SQLITE_OPEN_READWRITE;
-   bool retval = true;
+   string& str = *((string *) storage);
 
-   if (index_file == NULL)
+   if ((argc == 1) && (argv[0] != NULL))
    {
-      index_file = "TOKS";
+      str += str.empty() ? "" : " ";
+      str += azColName[0];
+      str += "=";
+      str += argv[0];
    }
+   return 0;
+}
 
-   if (create)
+/**
+ * Sets the storage parameters in cpd.storage on a shard. When indexing,
+ * the shard may be locked exclusively, and the parameters in effect are
+ * recorded in the Version table.
+ */
+static void index_set_storage(index_db *db, bool indexing)
+{
+   const storage_options& st = cpd.storage;
+   string sql, storage;
+   char pragma[64];
+
+   if (st.cache_size >= 0)
    {
-      open_flags |= SQLITE_OPEN_CREATE;
+      snprintf(pragma, sizeof(pragma), "PRAGMA cache_size=-%" PRId64 ";", st.cache_size);
+      sql += pragma;
    }
-
-   result = sqlite3_open_v2(index_file,
-                            &cpd.index,
-                            open_flags,
-                            NULL);
-
-   if (result == SQLITE_OK)
+   if (st.mmap_size >= 0)
    {
-      retval = index_check();
+      snprintf(pragma, sizeof(pragma), "PRAGMA mmap_size=%" PRId64 ";", st.mmap_size);
+      sql += pragma;
    }
-   else
+   if (st.temp_store >= 0)
    {
-      const char *errstr = sqlite3_errstr(result);
-      LOG_FMT(LERR, "index_open: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
-      retval = false;
+      snprintf(pragma, sizeof(pragma), "PRAGMA temp_store=%d;", st.temp_store);
+      sql += pragma;
+   }
+   /* --autotune leaves an index with WAL open to lookups */
+   if (indexing && ((st.exclusive > 0) || ((st.exclusive < 0) && st.autotune && !db->wal)))
+   {
+      sql += "PRAGMA locking_mode=EXCLUSIVE;";
    }
 
-   if (!retval)
+   if (!sql.empty())
    {
-      (void) sqlite3_close(cpd.index);
+      (void) sqlite3_exec(db->index, sql.c_str(), NULL, NULL, NULL);
    }
 
-   return retval;
+   if (indexing)
+   {
+      char *update;
+
+      (void) sqlite3_exec(
+         db->index,
+         "PRAGMA page_size;"
+         "PRAGMA cache_size;"
+         "PRAGMA mmap_size;"
+         "PRAGMA temp_store;"
+         "PRAGMA locking_mode;"
+         "PRAGMA journal_mode;",
+         index_storage_callback,
+         &storage,
+         NULL);
+      if (st.autotune)
+      {
+         storage += " autotune=1";
+      }
+
+      update = sqlite3_mprintf("UPDATE Version SET Storage=%Q", storage.c_str());
+      (void) sqlite3_exec(db->index, update, NULL, NULL, NULL);
+      sqlite3_free(update);
+   }
 }
 
-bool index_close(void)
+/**
+ * Writes the changes in the WAL of a shard to the index, at the end of a
+ * group of files, so the WAL doesn't grow and readers don't have to look
+ * through it. Passive checkpoints don't wait for readers.
+ */
+static void index_checkpoint(index_db *db, int mode)
 {
-   int result;
-   bool retval = true;
-
-   result = sqlite3_close(cpd.index);
-
-   if (result != SQLITE_OK)
+   if (db->wal)
    {
-      const char *errstr = sqlite3_errstr(result);
-      LOG_FMT(LERR, "index_close: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
-      retval = false;
+      (void) sqlite3_wal_checkpoint_v2(db->index, NULL, mode, NULL, NULL);
    }
-
-   return retval;
 }
 
-bool index_prepare_for_analysis(void)
+/* Commits the transaction of a shard, and checkpoints its WAL if it has one */
+static bool index_commit_group(index_db *db)
 {
    int result;
-   bool retval = true;
 
-   result = sqlite3_prepare_v2(cpd.index,
-                               "INSERT INTO Refs VALUES(?,?,?,?,?,?)",
-                               -1,
-                               &cpd.stmt_insert_reference,
-                               NULL);
+   (void) sqlite3_reset(db->stmt_commit);
+   result = sqlite3_step(db->stmt_commit);
+   db->group_files = 0;
+   index_checkpoint(db, SQLITE_CHECKPOINT_PASSIVE);
+   return result == SQLITE_DONE;
+}
 
-   if (result == SQLITE_OK)
-   {
-      result |= sqlite3_prepare_v2(cpd.index,
-                                  "INSERT INTO Defs VALUES(?,?,?,?,?,?)",
-                                  -1,
-                                  &cpd.stmt_insert_definition,
-                                  NULL);
-   }
+/**
+ * The distance between two files in the directory tree: two for each
+ * directory between them, plus one if they are not the same file.
+ */
+static int path_distance(const char *a, const char *b)
+{
+   int common = 0, distance = 0;
+   int i;
 
-   if (result == SQLITE_OK)
-   {
-      result |= sqlite3_prepare_v2(cpd.index,
-                                  "INSERT INTO Decls VALUES(?,?,?,?,?,?)",
-                                  -1,
-                                  &cpd.stmt_insert_declaration,
-                                  NULL);
-   }
+   while ((a[0] == '.') && (a[1] == '/'))
+      a += 2;
+   while ((b[0] == '.') && (b[1] == '/'))
+      b += 2;
 
-   if (result == SQLITE_OK)
+   for (i = 0; (a[i] != 0) && (a[i] == b[i]); i++)
    {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "BEGIN",
-                                  -1,
-                                  &cpd.stmt_begin,
-                                  NULL);
+      if (a[i] == '/')
+         common = i + 1;
    }
-
-   if (result == SQLITE_OK)
+   if ((a[i] != 0) || (b[i] != 0))
    {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "COMMIT",
-                                  -1,
-                                  &cpd.stmt_commit,
-                                  NULL);
+      distance = 1;
    }
 
-   if (result == SQLITE_OK)
+   for (i = common; a[i] != 0; i++)
    {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "INSERT INTO Files VALUES(?,?)",
-                                  -1,
-                                  &cpd.stmt_insert_file,
-                                  NULL);
+      if (a[i] == '/')
+         distance += 2;
    }
-
-   if (result == SQLITE_OK)
+   for (i = common; b[i] != 0; i++)
    {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "DELETE FROM Files WHERE rowid=?",
-                                  -1,
-                                  &cpd.stmt_remove_file,
-                                  NULL);
+      if (b[i] == '/')
+         distance += 2;
    }
 
-   if (result == SQLITE_OK)
-   {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "DELETE FROM Refs WHERE Filerow=?",
-                                  -1,
-                                  &cpd.stmt_prune_refs,
-                                  NULL);
-   }
+   return distance;
+}
 
-   if (result == SQLITE_OK)
-   {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "DELETE FROM Defs WHERE Filerow=?",
-                                  -1,
-                                  &cpd.stmt_prune_defs,
-                                  NULL);
-   }
+static void path_distance_function(
+   sqlite3_context *context,
+   int argc,
+   sqlite3_value **argv)
+{
+   const char *a = (const char *) sqlite3_value_text(argv[0]);
+   const char *b = (const char *) sqlite3_value_text(argv[1]);
 
-   if (result == SQLITE_OK)
+   if ((a == NULL) || (b == NULL))
    {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "DELETE FROM Decls WHERE Filerow=?",
-                                  -1,
-                                  &cpd.stmt_prune_decls,
-                                  NULL);
+      sqlite3_result_null(context);
    }
-
-   if (result == SQLITE_OK)
+   else
    {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "UPDATE Files SET Digest=? WHERE Filename=?",
-                                  -1,
-                                  &cpd.stmt_change_digest,
-                                  NULL);
+      sqlite3_result_int(context, path_distance(a, b));
    }
+}
 
-   if (result == SQLITE_OK)
+/* Splits a scope like "classa:func{}" into its names without decorations */
+static void split_scope(const char *scope, vector<string>& names)
+{
+   string name;
+
+   names.clear();
+   if (strcmp(scope, "<global>") == 0)
    {
-      result = sqlite3_prepare_v2(cpd.index,
-                                  "SELECT rowid,Digest FROM Files WHERE Filename=?",
-                                  -1,
-                                  &cpd.stmt_lookup_file,
-                                  NULL);
+      return;
    }
 
-   if (result != SQLITE_OK)
+   for (;; scope++)
    {
-      const char *errstr = sqlite3_errstr(result);
-      LOG_FMT(LERR, "index_prepare_for_analysis: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
-      retval = false;
+      if ((*scope == ':') || (*scope == 0))
+      {
+         while (!name.empty() && strchr("{}()[]<>", name[name.size() - 1]) != NULL)
+         {
+            name.erase(name.size() - 1);
+         }
+         names.push_back(name);
+         name.clear();
+         if (*scope == 0)
+            break;
+      }
+      else
+      {
+         name += *scope;
+      }
    }
-
-   return retval;
 }
 
-void index_end_analysis(void)
+/**
+ * How well an entry in one scope matches a use in another: the number of
+ * scopes of the use that are not scopes of the entry if the entry is in a
+ * scope enclosing the use, otherwise 1000 more than that.
+ */
+static int scope_distance(const char *entry, const char *use)
 {
-   (void) sqlite3_finalize(cpd.stmt_insert_reference);
-   (void) sqlite3_finalize(cpd.stmt_insert_definition);
-   (void) sqlite3_finalize(cpd.stmt_insert_declaration);
-   (void) sqlite3_finalize(cpd.stmt_begin);
-   (void) sqlite3_finalize(cpd.stmt_commit);
-   (void) sqlite3_finalize(cpd.stmt_insert_file);
-   (void) sqlite3_finalize(cpd.stmt_remove_file);
-   (void) sqlite3_finalize(cpd.stmt_prune_refs);
-   (void) sqlite3_finalize(cpd.stmt_prune_defs);
-   (void) sqlite3_finalize(cpd.stmt_prune_decls);
-   (void) sqlite3_finalize(cpd.stmt_change_digest);
-   (void) sqlite3_finalize(cpd.stmt_lookup_file);
+   vector<string> entry_names, use_names;
+   size_t common = 0;
+
+   split_scope(entry, entry_names);
+   split_scope(use, use_names);
+
+   while ((common < entry_names.size()) && (common < use_names.size()) &&
+          (entry_names[common] == use_names[common]))
+   {
+      common++;
+   }
+
+   return (int) (use_names.size() - common) + ((common < entry_names.size()) ? 1000 : 0);
 }
 
-static int index_insert_file(
-   const char *digest,
-   const char *filename,
-   sqlite3_int64 *filerow)
+static void scope_distance_function(
+   sqlite3_context *context,
+   int argc,
+   sqlite3_value **argv)
 {
-   int result;
-
-   result = sqlite3_bind_text(cpd.stmt_insert_file,
-                              1,
-                              digest,
-                              -1,
-                              SQLITE_STATIC);
+   const char *a = (const char *) sqlite3_value_text(argv[0]);
+   const char *b = (const char *) sqlite3_value_text(argv[1]);
 
-   if (result == SQLITE_OK)
+   if ((a == NULL) || (b == NULL))
    {
-      result = sqlite3_bind_text(cpd.stmt_insert_file,
-                                 2,
-                                 filename,
-                                 -1,
-                                 SQLITE_STATIC);
+      sqlite3_result_null(context);
    }
-
-   if (result == SQLITE_OK)
+   else
    {
-      result = sqlite3_step(cpd.stmt_insert_file);
-      if (result == SQLITE_DONE)
-      {
-         result = sqlite3_reset(cpd.stmt_insert_file);
-      }
+      sqlite3_result_int(context, scope_distance(a, b));
    }
+}
 
-   *filerow = sqlite3_last_insert_rowid(cpd.index);
+/**
+ * The hash of a path that decides which shard a file is stored in. It must
+ * not change, as the files are looked up in the shard of their hash.
+ */
+static UINT32 path_hash(const char *filename)
+{
+   UINT32 hash = 2166136261U;
 
-   return result;
+   for (; *filename != 0; filename++)
+   {
+      hash = (hash ^ (UINT8) *filename) * 16777619U;
+   }
+   return hash;
 }
 
-static int index_prune_entries(sqlite3_int64 filerow)
+static void path_hash_function(
+   sqlite3_context *context,
+   int argc,
+   sqlite3_value **argv)
 {
-   int result;
-
-   result = sqlite3_bind_int64(cpd.stmt_prune_refs,
-                               1,
-                               filerow);
+   const char *filename = (const char *) sqlite3_value_text(argv[0]);
 
-   if (result == SQLITE_OK)
+   if (filename == NULL)
    {
-      result = sqlite3_step(cpd.stmt_prune_refs);
-      if (result == SQLITE_DONE)
-      {
-         result = sqlite3_reset(cpd.stmt_prune_refs);
-      }
+      sqlite3_result_null(context);
    }
-
-   if (result == SQLITE_OK)
+   else
    {
-      result = sqlite3_bind_int64(cpd.stmt_prune_defs,
-                                  1,
-                                  filerow);
+      sqlite3_result_int64(context, path_hash(filename));
    }
+}
 
-   if (result == SQLITE_OK)
+/**
+ * Checks if a file is in the partition given with --shard i/N. The
+ * partition is decided by the path hash too, but scrambled, so the files
+ * of a partition are spread over all shards of a sharded index.
+ */
+bool index_in_partition(const char *filename)
+{
+   UINT32 hash = path_hash(filename);
+
+   if (cpd.partitions == 0)
    {
-      result = sqlite3_step(cpd.stmt_prune_defs);
-      if (result == SQLITE_DONE)
-      {
-         result = sqlite3_reset(cpd.stmt_prune_defs);
-      }
+      return true;
    }
 
+   hash ^= hash >> 16;
+   hash *= 0x85ebca6bU;
+   hash ^= hash >> 13;
+   hash *= 0xc2b2ae35U;
+   hash ^= hash >> 16;
+
+   return (hash % cpd.partitions) == cpd.partition;
+}
+
+/* Adds the SQL functions used by the lookups to a connection */
+static int index_create_functions(sqlite3 *index)
+{
+   int result;
+
+   result = sqlite3_create_function(index,
+                                    "PathDistance",
+                                    2,
+                                    SQLITE_UTF8,
+                                    NULL,
+                                    path_distance_function,
+                                    NULL,
+                                    NULL);
+
    if (result == SQLITE_OK)
    {
-      result = sqlite3_bind_int64(cpd.stmt_prune_decls,
-                                  1,
-                                  filerow);
+      result = sqlite3_create_function(index,
+                                       "ScopeDistance",
+                                       2,
+                                       SQLITE_UTF8,
+                                       NULL,
+                                       scope_distance_function,
+                                       NULL,
+                                       NULL);
    }
 
    if (result == SQLITE_OK)
    {
-      result = sqlite3_step(cpd.stmt_prune_decls);
-      if (result == SQLITE_DONE)
-      {
-         result = sqlite3_reset(cpd.stmt_prune_decls);
-      }
+      result = sqlite3_create_function(index,
+                                       "PathHash",
+                                       1,
+                                       SQLITE_UTF8,
+                                       NULL,
+                                       path_hash_function,
+                                       NULL,
+                                       NULL);
    }
 
    return result;
 }
 
-static int index_remove_file(sqlite3_int64 filerow)
+static bool file_exists(const char *filename)
 {
-   int result;
+   struct stat buffer;
+   return stat(filename, &buffer) == 0;
+}
 
-   result = sqlite3_bind_int64(cpd.stmt_remove_file,
-                               1,
+static bool is_directory(const char *path)
+{
+   struct stat buffer;
+   return (stat(path, &buffer) == 0) && S_ISDIR(buffer.st_mode);
+}
+
+static bool make_directory(const char *path)
+{
+#ifdef WIN32
+   return mkdir(path) == 0;
+#else
+   return mkdir(path, 0777) == 0;
+#endif
+}
+
+static string shard_filename(const string& dir, int shard)
+{
+   char name[32];
+
+   snprintf(name, sizeof(name), "/%d.idx", shard);
+   return dir + name;
+}
+
+/**
+ * Gets the files of the shards of an index. An index is either a single
+ * file, or a directory with the shards 0.idx to <N-1>.idx. A new index is
+ * a directory if cpd.shard_count is more than 1.
+ */
+static bool index_shard_files(const char *index_file, bool create, vector<string>& files)
+{
+   files.clear();
+
+   if (is_directory(index_file))
+   {
+      for (int i = 0; file_exists(shard_filename(index_file, i).c_str()); i++)
+      {
+         files.push_back(shard_filename(index_file, i));
+      }
+      if (files.empty())
+      {
+         LOG_FMT(LERR, "%s: no shards in %s\n", __func__, index_file);
+         return false;
+      }
+   }
+   else if (create && (cpd.shard_count > 1) && !file_exists(index_file))
+   {
+      if (!make_directory(index_file))
+      {
+         LOG_FMT(LERR, "%s: mkdir(%s) failed: %s (%d)\n",
+                 __func__, index_file, strerror(errno), errno);
+         return false;
+      }
+      for (int i = 0; i < cpd.shard_count; i++)
+      {
+         files.push_back(shard_filename(index_file, i));
+      }
+   }
+   else
+   {
+      files.push_back(index_file);
+   }
+
+   return true;
+}
+
+static void index_db_close(index_db *db)
+{
+   for (int i = 0; i < (int) ARRAY_SIZE(db->stmt_lookup); i++)
+   {
+      (void) sqlite3_finalize(db->stmt_lookup[i]);
+   }
+   (void) sqlite3_close(db->index);
+   (void) sqlite3_close(db->file_lock);
+   delete db;
+}
+
+/* Copies all pages of one database to another */
+static int index_backup(sqlite3 *dst, sqlite3 *src)
+{
+   sqlite3_backup *backup = sqlite3_backup_init(dst, "main", src, "main");
+   int result;
+
+   if (backup == NULL)
+   {
+      return sqlite3_errcode(dst);
+   }
+
+   result = sqlite3_backup_step(backup, -1);
+   if (result == SQLITE_DONE)
+   {
+      result = SQLITE_OK;
+   }
+   (void) sqlite3_backup_finish(backup);
+
+   return result;
+}
+
+/**
+ * Opens the file of a shard with an exclusive lock, so no other process
+ * reads or changes it until the returned connection is closed.
+ */
+static int index_lock_file(const string& file, sqlite3 **target)
+{
+   int result;
+
+   result = sqlite3_open_v2(file.c_str(),
+                            target,
+                            SQLITE_OPEN_READWRITE,
+                            NULL);
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_exec(*target,
+                            "PRAGMA locking_mode=EXCLUSIVE;"
+                            "BEGIN EXCLUSIVE;"
+                            "COMMIT",
+                            NULL, NULL, NULL);
+   }
+
+   if (result != SQLITE_OK)
+   {
+      LOG_FMT(LERR, "%s: index is in use\n", file.c_str());
+      (void) sqlite3_close(*target);
+      *target = NULL;
+   }
+
+   return result;
+}
+
+/**
+ * Checkpoints and removes the write-ahead log of a locked shard file by
+ * leaving WAL mode, as the log and its index would otherwise be applied to
+ * the file that replaces it.
+ */
+static int index_drop_wal(sqlite3 *target, const string& file)
+{
+   bool wal = false;
+   int result;
+
+   result = sqlite3_exec(target,
+                         "PRAGMA journal_mode=DELETE",
+                         index_journal_mode_callback,
+                         &wal,
+                         NULL);
+
+   if ((result == SQLITE_OK) && wal)
+   {
+      result = SQLITE_BUSY;
+   }
+
+   /* Left by WAL mode, no other process has it mapped */
+   if (result == SQLITE_OK)
+   {
+      (void) unlink((file + "-shm").c_str());
+   }
+
+   return result;
+}
+
+/**
+ * Opens a shard in memory for --in-memory-build, with the contents of its
+ * file if it exists. The file is locked until index_save() replaces it, so
+ * no other process changes it in the meantime.
+ */
+static int index_load_shard(index_db *db, const char *filename)
+{
+   int page_size = 0;
+   int result;
+
+   db->file = filename;
+
+   result = sqlite3_open_v2(":memory:",
+                            &db->index,
+                            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                            NULL);
+
+   if ((result == SQLITE_OK) && file_exists(filename))
+   {
+      result = index_lock_file(db->file, &db->file_lock);
+
+      if (result == SQLITE_OK)
+      {
+         result = sqlite3_exec(db->file_lock,
+                               "PRAGMA journal_mode",
+                               index_journal_mode_callback,
+                               &db->file_wal,
+                               NULL);
+      }
+
+      /* A backup to memory can't change the page size */
+      if (result == SQLITE_OK)
+      {
+         result = sqlite3_exec(db->file_lock,
+                               "PRAGMA page_size",
+                               index_version_check_callback,
+                               &page_size,
+                               NULL);
+      }
+
+      if (result == SQLITE_OK)
+      {
+         char pragma[64];
+
+         snprintf(pragma, sizeof(pragma), "PRAGMA page_size=%d", page_size);
+         result = sqlite3_exec(db->index, pragma, NULL, NULL, NULL);
+      }
+
+      if (result == SQLITE_OK)
+      {
+         result = index_backup(db->index, db->file_lock);
+      }
+   }
+
+   return result;
+}
+
+/* Writes an in-memory shard to its file, which is replaced in one step */
+static bool index_save_shard(index_db *db)
+{
+   string tmp = db->file + ".tmp";
+   sqlite3 *target;
+   sqlite3 *disk = NULL;
+   int result = SQLITE_OK;
+
+   /* The file is locked since it was loaded, unless it was created since */
+   target = db->file_lock;
+   db->file_lock = NULL;
+   if ((target == NULL) && file_exists(db->file.c_str()))
+   {
+      result = index_lock_file(db->file, &target);
+   }
+
+   if ((result == SQLITE_OK) && (target != NULL))
+   {
+      result = index_drop_wal(target, db->file);
+   }
+
+   if (result != SQLITE_OK)
+   {
+      LOG_FMT(LERR, "index_save: %s: not replaced\n", db->file.c_str());
+      (void) sqlite3_close(target);
+      return false;
+   }
+
+   (void) unlink(tmp.c_str());
+
+   result = sqlite3_open_v2(tmp.c_str(),
+                            &disk,
+                            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                            NULL);
+
+   if (result == SQLITE_OK)
+   {
+      result = index_backup(disk, db->index);
+   }
+
+   /* The journal mode is not copied from a database in memory */
+   if ((result == SQLITE_OK) && (cpd.wal || db->file_wal))
+   {
+      result = sqlite3_exec(disk, "PRAGMA journal_mode=WAL", NULL, NULL, NULL);
+   }
+
+   if (sqlite3_close(disk) != SQLITE_OK)
+   {
+      result = SQLITE_IOERR;
+   }
+
+   if ((result == SQLITE_OK) && (rename(tmp.c_str(), db->file.c_str()) != 0))
+   {
+      LOG_FMT(LERR, "%s: rename(%s) failed: %s (%d)\n",
+              __func__, tmp.c_str(), strerror(errno), errno);
+      result = SQLITE_IOERR;
+   }
+
+   /* Releases the lock on the replaced file */
+   (void) sqlite3_close(target);
+
+   if (result != SQLITE_OK)
+   {
+      const char *errstr = sqlite3_errstr(result);
+      LOG_FMT(LERR, "index_save: %s: access error (%d: %s)\n", db->file.c_str(), result, errstr != NULL ? errstr : "");
+      (void) unlink(tmp.c_str());
+   }
+
+   return result == SQLITE_OK;
+}
+
+/**
+ * Writes the shards of an index built in memory with --in-memory-build to
+ * their files, each in one sequential pass. Does nothing for an index on
+ * disk.
+ */
+bool index_save(void)
+{
+   bool retval = true;
+
+   for (size_t i = 0; i < cpd.shards.size(); i++)
+   {
+      if (!cpd.shards[i]->file.empty())
+      {
+         retval = index_save_shard(cpd.shards[i]) && retval;
+      }
+   }
+
+   return retval;
+}
+
+/**
+ * Opens the shards of an index. If check is set, the shards are checked
+ * and created if needed, and cpd.db is set to the first shard. With
+ * cpd.in_memory they are then opened in memory.
+ */
+static bool index_open_shards(
+   const char *index_file,
+   int open_flags,
+   bool check,
+   vector<index_db *>& shards)
+{
+   vector<string> files;
+   bool retval;
+
+   retval = index_shard_files(index_file, (open_flags & SQLITE_OPEN_CREATE) != 0, files);
+
+   if (retval && check && (cpd.shard_count > 0) && (cpd.shard_count != (int) files.size()))
+   {
+      LOG_FMT(LERR, "Index has %d shards, use --reshard to change it\n", (int) files.size());
+      retval = false;
+   }
+
+   for (size_t i = 0; retval && (i < files.size()); i++)
+   {
+      index_db *db = new index_db();
+      int result;
+
+      shards.push_back(db);
+
+      if (cpd.in_memory && check)
+      {
+         result = index_load_shard(db, files[i].c_str());
+      }
+      else
+      {
+         result = sqlite3_open_v2(files[i].c_str(),
+                                  &db->index,
+                                  open_flags,
+                                  NULL);
+      }
+
+      if (result == SQLITE_OK)
+      {
+         result = index_create_functions(db->index);
+      }
+
+      if ((result == SQLITE_OK) && check)
+      {
+         cpd.db = db;
+         retval = index_check();
+      }
+
+      if (result == SQLITE_OK)
+      {
+         index_set_storage(db, check && retval && ((open_flags & SQLITE_OPEN_CREATE) != 0));
+      }
+      else
+      {
+         const char *errstr = sqlite3_errstr(result);
+         LOG_FMT(LERR, "index_open: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+         retval = false;
+      }
+   }
+
+   if (!retval)
+   {
+      for (size_t i = 0; i < shards.size(); i++)
+      {
+         index_db_close(shards[i]);
+      }
+      shards.clear();
+   }
+
+   if (check)
+   {
+      cpd.db = shards.empty() ? NULL : shards[0];
+   }
+
+   return retval;
+}
+
+/* The memory available to the process in bytes, or 0 if not known */
+static UINT64 available_memory(void)
+{
+   UINT64 memory = 0;
+
+#ifdef __linux__
+   FILE *p_file = fopen("/proc/meminfo", "r");
+   char line[128];
+
+   while ((p_file != NULL) && (fgets(line, sizeof(line), p_file) != NULL))
+   {
+      unsigned long long kib;
+
+      if (sscanf(line, "MemAvailable: %llu kB", &kib) == 1)
+      {
+         memory = (UINT64) kib * 1024;
+         break;
+      }
+   }
+   if (p_file != NULL)
+   {
+      fclose(p_file);
+   }
+#endif
+#ifdef _SC_PHYS_PAGES
+   if (memory == 0)
+   {
+      long pages = sysconf(_SC_PHYS_PAGES);
+      long page_size = sysconf(_SC_PAGESIZE);
+
+      if ((pages > 0) && (page_size > 0))
+      {
+         memory = (UINT64) pages * page_size / 2;
+      }
+   }
+#endif
+
+   return memory;
+}
+
+/**
+ * Chooses the storage parameters that are not set in cpd.storage for
+ * --autotune, from the size of the index and the available memory.
+ *
+ * @param index_file  The index, which may not exist yet
+ * @param indexing    The index is opened for analysis, not only lookups
+ */
+void index_autotune(const char *index_file, bool indexing)
+{
+   storage_options& st = cpd.storage;
+   vector<string> files;
+   UINT64 memory = available_memory();
+   UINT64 size = 0, largest = 0;
+   size_t shards;
+
+   if (index_file == NULL)
+   {
+      index_file = "TOKS";
+   }
+
+   st.autotune = true;
+
+   if (index_shard_files(index_file, false, files))
+   {
+      for (size_t i = 0; i < files.size(); i++)
+      {
+         struct stat buffer;
+
+         if (stat(files[i].c_str(), &buffer) == 0)
+         {
+            size += buffer.st_size;
+            largest = ((UINT64) buffer.st_size > largest) ? buffer.st_size : largest;
+         }
+      }
+   }
+   shards = (files.size() > 1) ? files.size() : (cpd.shard_count > 1) ? cpd.shard_count : 1;
+
+   if ((size == 0) && (st.page_size < 0))
+   {
+      st.page_size = AUTOTUNE_PAGE_SIZE;
+   }
+
+   if (memory > 0)
+   {
+      /* A page cache that holds the whole index, within a quarter of the memory */
+      if (indexing && (st.cache_size < 0))
+      {
+         UINT64 cache = (size > 0) ? size + size / 4 : AUTOTUNE_NEW_CACHE;
+
+         cache = ((cache < memory / 4) ? cache : memory / 4) / shards;
+         if (cache > 2 * 1024 * 1024)
+         {
+            st.cache_size = cache / 1024;
+         }
+      }
+
+      /* Map each shard in full, with room to grow */
+      if ((st.mmap_size < 0) && (largest > 0) && (largest + largest / 4 <= memory / 2))
+      {
+         st.mmap_size = largest + largest / 4;
+      }
+
+      if ((st.temp_store < 0) && (memory >= 1024 * 1024 * 1024))
+      {
+         st.temp_store = 2;
+      }
+   }
+
+   LOG_FMT(LNOTE, "Autotune: index %" PRIu64 " bytes, memory %" PRIu64 " bytes, "
+           "page_size %d, cache_size %" PRId64 " KiB, mmap_size %" PRId64 ", temp_store %d\n",
+           size, memory, st.page_size, st.cache_size, st.mmap_size, st.temp_store);
+}
+
+bool index_open(const char *index_file, bool create)
+{
+   int open_flags = SQLITE_OPEN_READWRITE;
+
+   if (index_file == NULL)
+   {
+      index_file = "TOKS";
+   }
+
+   if (create)
+   {
+      open_flags |= SQLITE_OPEN_CREATE;
+   }
+
+   return index_open_shards(index_file, open_flags, true, cpd.shards);
+}
+
+bool index_close(void)
+{
+   int result;
+   bool retval = true;
+
+   for (size_t i = 0; i < cpd.shards.size(); i++)
+   {
+      index_db *db = cpd.shards[i];
+
+      for (int j = 0; j < (int) ARRAY_SIZE(db->stmt_lookup); j++)
+      {
+         (void) sqlite3_finalize(db->stmt_lookup[j]);
+         db->stmt_lookup[j] = NULL;
+      }
+
+      result = sqlite3_close(db->index);
+
+      if (result != SQLITE_OK)
+      {
+         const char *errstr = sqlite3_errstr(result);
+         LOG_FMT(LERR, "index_close: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+         retval = false;
+      }
+      delete db;
+   }
+   cpd.shards.clear();
+   cpd.db = NULL;
+
+   return retval;
+}
+
+/* The shard a file is stored in */
+static index_db *index_shard(const char *filename)
+{
+   return cpd.shards[path_hash(filename) % cpd.shards.size()];
+}
+
+/**
+ * Calls fn with each of the args, in parallel with a thread for each but
+ * the first. Returns true if all calls returned non-NULL.
+ */
+static bool run_parallel(void *(*fn)(void *), const vector<void *>& args)
+{
+   bool retval = true;
+
+#ifndef WIN32
+   vector<pthread_t> threads(args.size());
+   vector<char> started(args.size());
+
+   for (size_t i = 1; i < args.size(); i++)
+   {
+      started[i] = (pthread_create(&threads[i], NULL, fn, args[i]) == 0);
+   }
+   for (size_t i = 0; i < args.size(); i++)
+   {
+      if ((i == 0) || !started[i])
+      {
+         retval = (fn(args[i]) != NULL) && retval;
+      }
+   }
+   for (size_t i = 1; i < args.size(); i++)
+   {
+      void *ok = NULL;
+
+      if (started[i])
+      {
+         pthread_join(threads[i], &ok);
+         retval = (ok != NULL) && retval;
+      }
+   }
+#else
+   for (size_t i = 0; i < args.size(); i++)
+   {
+      retval = (fn(args[i]) != NULL) && retval;
+   }
+#endif
+
+   return retval;
+}
+
+static vector<void *> shard_args(void)
+{
+   return vector<void *>(cpd.shards.begin(), cpd.shards.end());
+}
+
+static int index_files_empty_callback(
+   void *empty,
+   int argc,
+   char **argv,
+   char **azColName)
+{
+   *((bool *) empty) = false;
+   return 0;
+}
+
+static const char create_location_indexes[] =
+   "CREATE INDEX IF NOT EXISTS RefsLocation ON Refs(Filerow, Line, ColumnStart);"
+   "CREATE INDEX IF NOT EXISTS DefsLocation ON Defs(Filerow, Line, ColumnStart);"
+   "CREATE INDEX IF NOT EXISTS DeclsLocation ON Decls(Filerow, Line, ColumnStart);";
+
+static void *create_lookup_indexes_thread(void *arg)
+{
+   index_db *db = (index_db *) arg;
+   int result;
+   char *errmsg = NULL;
+
+   result = sqlite3_exec(db->index,
+                         "CREATE INDEX IF NOT EXISTS RefsIdentifier ON Refs(Identifier, Type);"
+                         "CREATE INDEX IF NOT EXISTS DefsIdentifier ON Defs(Identifier, Type);"
+                         "CREATE INDEX IF NOT EXISTS DeclsIdentifier ON Decls(Identifier, Type);",
+                         NULL,
+                         NULL,
+                         &errmsg);
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_exec(db->index,
+                            create_location_indexes,
+                            NULL,
+                            NULL,
+                            &errmsg);
+      db->bulk = false;
+   }
+
+   if (result != SQLITE_OK)
+   {
+      LOG_FMT(LERR, "index_create_lookup_indexes: access error (%d: %s)\n", result, errmsg != NULL ? errmsg : "");
+   }
+
+   sqlite3_free(errmsg);
+
+   return (result == SQLITE_OK) ? arg : NULL;
+}
+
+/**
+ * Creates the indexes used by the lookups, if they don't exist. They are
+ * not maintained while an empty index is filled, as it is faster to
+ * create them once all entries have been added. The shards are indexed in
+ * parallel.
+ */
+bool index_create_lookup_indexes(void)
+{
+   return run_parallel(create_lookup_indexes_thread, shard_args());
+}
+
+static const char *lookup_tables[] =
+{
+   "Refs",     /* IST_REFERENCE */
+   "Defs",     /* IST_DEFINITION */
+   "Decls",    /* IST_DECLARATION */
+};
+
+/* Prepares the statements of the shard cpd.db */
+static bool index_prepare_shard(void)
+{
+   int result;
+   bool retval = true;
+   bool empty = true;
+
+   result = sqlite3_exec(cpd.db->index,
+                         "SELECT 1 FROM Files UNION ALL SELECT 1 FROM Cached LIMIT 1",
+                         index_files_empty_callback,
+                         &empty,
+                         NULL);
+
+   if ((result == SQLITE_OK) && empty)
+   {
+      result = sqlite3_exec(cpd.db->index,
+                            "DROP INDEX IF EXISTS RefsIdentifier;"
+                            "DROP INDEX IF EXISTS DefsIdentifier;"
+                            "DROP INDEX IF EXISTS DeclsIdentifier;"
+                            "DROP INDEX IF EXISTS RefsLocation;"
+                            "DROP INDEX IF EXISTS DefsLocation;"
+                            "DROP INDEX IF EXISTS DeclsLocation;",
+                            NULL,
+                            NULL,
+                            NULL);
+      cpd.db->bulk = true;
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "INSERT INTO Refs VALUES(?,?,?,?,?,?)",
+                                  -1,
+                                  &cpd.db->stmt_insert_reference,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result |= sqlite3_prepare_v2(cpd.db->index,
+                                  "INSERT INTO Defs VALUES(?,?,?,?,?,?)",
+                                  -1,
+                                  &cpd.db->stmt_insert_definition,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result |= sqlite3_prepare_v2(cpd.db->index,
+                                  "INSERT INTO Decls VALUES(?,?,?,?,?,?)",
+                                  -1,
+                                  &cpd.db->stmt_insert_declaration,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "BEGIN",
+                                  -1,
+                                  &cpd.db->stmt_begin,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "COMMIT",
+                                  -1,
+                                  &cpd.db->stmt_commit,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "INSERT INTO Files VALUES(?,?,?,0,strftime('%s','now'),?,0,0)",
+                                  -1,
+                                  &cpd.db->stmt_insert_file,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "DELETE FROM Files WHERE rowid=?",
+                                  -1,
+                                  &cpd.db->stmt_remove_file,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "DELETE FROM Refs WHERE Filerow=?",
+                                  -1,
+                                  &cpd.db->stmt_prune_refs,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "DELETE FROM Defs WHERE Filerow=?",
+                                  -1,
+                                  &cpd.db->stmt_prune_defs,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "DELETE FROM Decls WHERE Filerow=?",
+                                  -1,
+                                  &cpd.db->stmt_prune_decls,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "UPDATE Files SET Digest=?1,Mode=?2,Degraded=0,Indexed=strftime('%s','now'),Lang=?4,MaxTokens=0,MaxParseTime=0 WHERE Filename=?3",
+                                  -1,
+                                  &cpd.db->stmt_change_digest,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "SELECT rowid,Digest,Mode,Degraded,MaxTokens,MaxParseTime FROM Files WHERE Filename=?",
+                                  -1,
+                                  &cpd.db->stmt_lookup_file,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "UPDATE Files SET Mode=?,Degraded=?,MaxTokens=?,MaxParseTime=? WHERE rowid=?",
+                                  -1,
+                                  &cpd.db->stmt_degrade_file,
+                                  NULL);
+   }
+
+   /* The entries of a file and their changes, see index_apply_delta() */
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "SELECT rowid,Line,ColumnStart,Scope,Type,Identifier,0 FROM Refs WHERE Filerow=?1 UNION ALL "
+                                  "SELECT rowid,Line,ColumnStart,Scope,Type,Identifier,1 FROM Defs WHERE Filerow=?1 UNION ALL "
+                                  "SELECT rowid,Line,ColumnStart,Scope,Type,Identifier,2 FROM Decls WHERE Filerow=?1",
+                                  -1,
+                                  &cpd.db->stmt_file_entries,
+                                  NULL);
+   }
+
+   for (int i = 0; (result == SQLITE_OK) && (i < (int) ARRAY_SIZE(lookup_tables)); i++)
+   {
+      char *sql = sqlite3_mprintf("DELETE FROM %s WHERE rowid=?", lookup_tables[i]);
+
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  sql,
+                                  -1,
+                                  &cpd.db->stmt_delete_entry[i],
+                                  NULL);
+      sqlite3_free(sql);
+
+      if (result == SQLITE_OK)
+      {
+         sql = sqlite3_mprintf("UPDATE %s SET Line=?,ColumnStart=? WHERE rowid=?", lookup_tables[i]);
+         result = sqlite3_prepare_v2(cpd.db->index,
+                                     sql,
+                                     -1,
+                                     &cpd.db->stmt_move_entry[i],
+                                     NULL);
+         sqlite3_free(sql);
+      }
+
+      if (result == SQLITE_OK)
+      {
+         sql = sqlite3_mprintf("UPDATE %s SET Filerow=?1 WHERE Filerow=?2", lookup_tables[i]);
+         result = sqlite3_prepare_v2(cpd.db->index,
+                                     sql,
+                                     -1,
+                                     &cpd.db->stmt_move_entries[i],
+                                     NULL);
+         sqlite3_free(sql);
+      }
+   }
+
+   /* The parse cache, see index_find_content(). Mode 0 is PM_FULL. */
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "SELECT -rowid,Mode,Degraded FROM Cached "
+                                  "WHERE Digest=?1 AND Lang=?2 AND (Mode=0 OR Mode=?3) AND Degraded=?5 UNION ALL "
+                                  "SELECT rowid,Mode,Degraded FROM Files "
+                                  "WHERE Digest=?1 AND Lang=?2 AND (Mode=0 OR Mode=?3) AND Degraded=?5 AND Filename<>?4 "
+                                  "LIMIT 1",
+                                  -1,
+                                  &cpd.db->stmt_find_content,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "INSERT INTO Cached SELECT Digest,Lang,Mode,Degraded,strftime('%s','now') FROM Files "
+                                  "WHERE rowid=?1 AND NOT EXISTS (SELECT 1 FROM Cached AS c "
+                                  "WHERE c.Digest=Files.Digest AND c.Lang=Files.Lang AND c.Mode=Files.Mode AND c.Degraded=Files.Degraded)",
+                                  -1,
+                                  &cpd.db->stmt_cache_file,
+                                  NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "DELETE FROM Cached WHERE rowid=?",
+                                  -1,
+                                  &cpd.db->stmt_uncache_file,
+                                  NULL);
+   }
+
+   if (result != SQLITE_OK)
+   {
+      const char *errstr = sqlite3_errstr(result);
+      LOG_FMT(LERR, "index_prepare_for_analysis: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      retval = false;
+   }
+
+   return retval;
+}
+
+bool index_prepare_for_analysis(void)
+{
+   bool retval = true;
+
+   for (size_t i = 0; retval && (i < cpd.shards.size()); i++)
+   {
+      cpd.db = cpd.shards[i];
+      retval = index_prepare_shard();
+   }
+
+   return retval;
+}
+
+/* Finalizes the statements of the shard cpd.db */
+static void index_finalize_shard(void)
+{
+   (void) sqlite3_finalize(cpd.db->stmt_insert_reference);
+   (void) sqlite3_finalize(cpd.db->stmt_insert_definition);
+   (void) sqlite3_finalize(cpd.db->stmt_insert_declaration);
+   (void) sqlite3_finalize(cpd.db->stmt_begin);
+   (void) sqlite3_finalize(cpd.db->stmt_commit);
+   (void) sqlite3_finalize(cpd.db->stmt_insert_file);
+   (void) sqlite3_finalize(cpd.db->stmt_remove_file);
+   (void) sqlite3_finalize(cpd.db->stmt_prune_refs);
+   (void) sqlite3_finalize(cpd.db->stmt_prune_defs);
+   (void) sqlite3_finalize(cpd.db->stmt_prune_decls);
+   (void) sqlite3_finalize(cpd.db->stmt_change_digest);
+   (void) sqlite3_finalize(cpd.db->stmt_lookup_file);
+   (void) sqlite3_finalize(cpd.db->stmt_degrade_file);
+   (void) sqlite3_finalize(cpd.db->stmt_file_entries);
+   for (int i = 0; i < (int) ARRAY_SIZE(cpd.db->stmt_delete_entry); i++)
+   {
+      (void) sqlite3_finalize(cpd.db->stmt_delete_entry[i]);
+      (void) sqlite3_finalize(cpd.db->stmt_move_entry[i]);
+      (void) sqlite3_finalize(cpd.db->stmt_move_entries[i]);
+   }
+   (void) sqlite3_finalize(cpd.db->stmt_find_content);
+   (void) sqlite3_finalize(cpd.db->stmt_cache_file);
+   (void) sqlite3_finalize(cpd.db->stmt_uncache_file);
+}
+
+void index_end_analysis(void)
+{
+   for (size_t i = 0; i < cpd.shards.size(); i++)
+   {
+      if (!sqlite3_get_autocommit(cpd.shards[i]->index))
+      {
+         (void) index_commit_group(cpd.shards[i]);
+      }
+   }
+
+   (void) index_create_lookup_indexes();
+   (void) index_trim_cache();
+
+   for (size_t i = 0; i < cpd.shards.size(); i++)
+   {
+      cpd.db = cpd.shards[i];
+      index_finalize_shard();
+      index_checkpoint(cpd.db, SQLITE_CHECKPOINT_RESTART);
+   }
+}
+
+/**
+ * Copies the files of another index whose path hash modulo parts is part,
+ * with their entries, to an index. The files get new rows in the index.
+ * A file that is already in the index is replaced, unless it was analyzed
+ * later than the copy.
+ */
+static int index_copy_files(sqlite3 *index, const char *src_file, UINT32 part, UINT32 parts)
+{
+   int result;
+   bool none_replaced = true;
+   char *errmsg = NULL;
+   char *sql;
+
+   sql = sqlite3_mprintf("ATTACH %Q AS Src", src_file);
+   result = sqlite3_exec(index, sql, NULL, NULL, &errmsg);
+   sqlite3_free(sql);
+
+   if (result == SQLITE_OK)
+   {
+      sql = sqlite3_mprintf(
+         "BEGIN;"
+         "CREATE TEMP TABLE Copied(Src INTEGER PRIMARY KEY, Dst INTEGER);"
+         "INSERT INTO Copied(Src) SELECT s.rowid FROM Src.Files AS s "
+         "LEFT JOIN main.Files AS f ON f.Filename=s.Filename "
+         "WHERE PathHash(s.Filename)%%%u=%u AND (f.rowid IS NULL OR f.Indexed<=s.Indexed);"
+         "CREATE TEMP TABLE Replaced AS SELECT f.rowid AS Filerow FROM main.Files AS f "
+         "JOIN Src.Files AS s ON s.Filename=f.Filename WHERE s.rowid IN (SELECT Src FROM Copied);",
+         parts, part);
+      result = sqlite3_exec(index, sql, NULL, NULL, &errmsg);
+      sqlite3_free(sql);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_exec(index,
+                            "SELECT 1 FROM Replaced LIMIT 1",
+                            index_files_empty_callback,
+                            &none_replaced,
+                            &errmsg);
+   }
+
+   /* Only then, as the entry tables are scanned without the lookup indexes */
+   if ((result == SQLITE_OK) && !none_replaced)
+   {
+      result = sqlite3_exec(index,
+                            "DELETE FROM main.Refs WHERE Filerow IN (SELECT Filerow FROM Replaced);"
+                            "DELETE FROM main.Defs WHERE Filerow IN (SELECT Filerow FROM Replaced);"
+                            "DELETE FROM main.Decls WHERE Filerow IN (SELECT Filerow FROM Replaced);"
+                            "DELETE FROM main.Files WHERE rowid IN (SELECT Filerow FROM Replaced);",
+                            NULL,
+                            NULL,
+                            &errmsg);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_exec(index,
+                            "INSERT INTO main.Files(Digest,Filename,Mode,Degraded,Indexed,Lang,MaxTokens,MaxParseTime) "
+                            "SELECT Digest,Filename,Mode,Degraded,Indexed,Lang,MaxTokens,MaxParseTime FROM Src.Files WHERE rowid IN (SELECT Src FROM Copied);"
+                            "UPDATE Copied SET Dst=(SELECT f.rowid FROM main.Files AS f "
+                            "JOIN Src.Files AS s ON s.Filename=f.Filename WHERE s.rowid=Copied.Src);"
+                            "INSERT INTO main.Refs SELECT c.Dst,t.Line,t.ColumnStart,t.Scope,t.Type,t.Identifier "
+                            "FROM Copied AS c JOIN Src.Refs AS t ON t.Filerow=c.Src;"
+                            "INSERT INTO main.Defs SELECT c.Dst,t.Line,t.ColumnStart,t.Scope,t.Type,t.Identifier "
+                            "FROM Copied AS c JOIN Src.Defs AS t ON t.Filerow=c.Src;"
+                            "INSERT INTO main.Decls SELECT c.Dst,t.Line,t.ColumnStart,t.Scope,t.Type,t.Identifier "
+                            "FROM Copied AS c JOIN Src.Decls AS t ON t.Filerow=c.Src;"
+                            "COMMIT;",
+                            NULL,
+                            NULL,
+                            &errmsg);
+   }
+
+   if (result != SQLITE_OK)
+   {
+      LOG_FMT(LERR, "index_copy_files: %s: access error (%d: %s)\n", src_file, result, errmsg != NULL ? errmsg : "");
+      if (!sqlite3_get_autocommit(index))
+      {
+         (void) sqlite3_exec(index, "ROLLBACK", NULL, NULL, NULL);
+      }
+   }
+   (void) sqlite3_exec(index, "DROP TABLE IF EXISTS temp.Copied", NULL, NULL, NULL);
+   (void) sqlite3_exec(index, "DROP TABLE IF EXISTS temp.Replaced", NULL, NULL, NULL);
+   (void) sqlite3_exec(index, "DETACH Src", NULL, NULL, NULL);
+
+   sqlite3_free(errmsg);
+
+   return result;
+}
+
+/* Deletes an index file or a directory of shards */
+static bool index_delete(const char *index_file)
+{
+   if (!is_directory(index_file))
+   {
+      return unlink(index_file) == 0;
+   }
+
+   for (int i = 0; file_exists(shard_filename(index_file, i).c_str()); i++)
+   {
+      (void) unlink(shard_filename(index_file, i).c_str());
+   }
+   return rmdir(index_file) == 0;
+}
+
+/* Returns true if all shards of the open index use WAL */
+static bool index_is_wal(void)
+{
+   for (size_t i = 0; i < cpd.shards.size(); i++)
+   {
+      if (!cpd.shards[i]->wal)
+      {
+         return false;
+      }
+   }
+   return !cpd.shards.empty();
+}
+
+/**
+ * Changes the number of shards of an index. The files are copied to a new
+ * index with count shards, which then replaces the index. With a count of
+ * one the new index is a single file. A WAL index stays in WAL mode.
+ */
+bool index_reshard(const char *index_file, int count)
+{
+   vector<string> files;
+   string path, tmp, old;
+   bool wal = cpd.wal;
+   bool retval;
+
+   if (index_file == NULL)
+   {
+      index_file = "TOKS";
+   }
+   path = index_file;
+   tmp = path + ".reshard";
+   old = path + ".old";
+
+   if (file_exists(tmp.c_str()) || file_exists(old.c_str()))
+   {
+      LOG_FMT(LERR, "%s or %s exists, remove it to continue\n", tmp.c_str(), old.c_str());
+      return false;
+   }
+
+   /* Checks the index and gets its reference types for the new index */
+   cpd.shard_count = 0;
+   retval = index_open(index_file, false) && index_shard_files(index_file, false, files);
+   cpd.wal = wal || (retval && index_is_wal());
+   (void) index_close();
+
+   cpd.shard_count = count;
+   if (retval)
+   {
+      retval = index_open(tmp.c_str(), true);
+   }
+   cpd.wal = wal;
+
+   for (size_t k = 0; retval && (k < cpd.shards.size()); k++)
+   {
+      for (size_t i = 0; retval && (i < files.size()); i++)
+      {
+         retval = (index_copy_files(cpd.shards[k]->index, files[i].c_str(), k, count) == SQLITE_OK);
+      }
+   }
+
+   if (retval)
+   {
+      retval = index_create_lookup_indexes();
+   }
+   (void) index_close();
+
+   if (retval)
+   {
+      LOG_FMT(LNOTE, "Resharded %s from %d to %d shards\n", index_file, (int) files.size(), count);
+      retval = (rename(path.c_str(), old.c_str()) == 0) &&
+               (rename(tmp.c_str(), path.c_str()) == 0);
+      if (!retval)
+      {
+         LOG_FMT(LERR, "%s: renaming %s failed: %s (%d)\n",
+                 __func__, index_file, strerror(errno), errno);
+      }
+      else if (!index_delete(old.c_str()))
+      {
+         LOG_FMT(LWARN, "%s: deleting %s failed: %s (%d)\n",
+                 __func__, old.c_str(), strerror(errno), errno);
+      }
+   }
+   else if (file_exists(tmp.c_str()))
+   {
+      (void) index_delete(tmp.c_str());
+   }
+
+   return retval;
+}
+
+/**
+ * Merges indexes into an index, which is created if it doesn't exist. The
+ * files and their entries are copied without analyzing them again. A file
+ * that is in several indexes is taken from the one where it was analyzed
+ * last, or the last one given if at the same time. The lookup indexes of
+ * a new index are created once all files are copied. A new index uses WAL
+ * if all the inputs do.
+ */
+bool index_merge(const char *index_file, const deque<string>& inputs)
+{
+   vector<string> files;
+   int shard_count = cpd.shard_count;
+   bool wal = cpd.wal, all_wal = true;
+   bool retval = true;
+
+   if (index_file == NULL)
+   {
+      index_file = "TOKS";
+   }
+
+   /* The reference types of the first input apply to the others and the
+    * output, unless given on the command line */
+   cpd.shard_count = 0;
+   for (size_t i = 0; retval && (i < inputs.size()); i++)
+   {
+      vector<string> shard_files;
+
+      retval = index_open(inputs[i].c_str(), false) &&
+               index_shard_files(inputs[i].c_str(), false, shard_files);
+      all_wal = all_wal && index_is_wal();
+      (void) index_close();
+
+      if (!retval)
+      {
+         LOG_FMT(LERR, "Can't merge %s\n", inputs[i].c_str());
+      }
+      files.insert(files.end(), shard_files.begin(), shard_files.end());
+      cpd.ref_types_set = true;
+   }
+   cpd.shard_count = shard_count;
+
+   cpd.wal = wal || (all_wal && !inputs.empty());
+   if (retval)
+   {
+      retval = index_open(index_file, true);
+   }
+   cpd.wal = wal;
+
+   for (size_t k = 0; retval && (k < cpd.shards.size()); k++)
+   {
+      for (size_t i = 0; retval && (i < files.size()); i++)
+      {
+         retval = (index_copy_files(cpd.shards[k]->index, files[i].c_str(), k, cpd.shards.size()) == SQLITE_OK);
+      }
+   }
+
+   if (retval)
+   {
+      retval = index_create_lookup_indexes();
+      LOG_FMT(LNOTE, "Merged %d indexes into %s\n", (int) inputs.size(), index_file);
+   }
+   (void) index_close();
+
+   return retval;
+}
+
+static int index_int64_callback(
+   void *value,
+   int argc,
+   char **argv,
+   char **azColName)
+{
+   if ((argc >= 1) && (argv[0] != NULL))
+      *((sqlite3_int64 *) value) = strtoll(argv[0], NULL, 10);
+   return 0;
+}
+
+static void *maintain_thread(void *arg)
+{
+   index_db *db = (index_db *) arg;
+   sqlite3_int64 auto_vacuum = 0;
+   const char *sql;
+   char *errmsg = NULL;
+   int result;
+
+   (void) sqlite3_exec(db->index, "PRAGMA auto_vacuum", index_int64_callback, &auto_vacuum, NULL);
+
+   /* An index created before auto_vacuum=INCREMENTAL is converted by a
+    * VACUUM, which also rebuilds its indexes */
+   if (auto_vacuum == 2)
+   {
+      sql = "REINDEX;"
+            "PRAGMA incremental_vacuum;"
+            "ANALYZE;";
+   }
+   else
+   {
+      sql = "PRAGMA auto_vacuum=INCREMENTAL;"
+            "VACUUM;"
+            "ANALYZE;";
+   }
+
+   result = sqlite3_exec(db->index, sql, NULL, NULL, &errmsg);
+
+   if (result != SQLITE_OK)
+   {
+      LOG_FMT(LERR, "index_maintain: access error (%d: %s)\n", result, errmsg != NULL ? errmsg : "");
+   }
+   sqlite3_free(errmsg);
+
+   index_checkpoint(db, SQLITE_CHECKPOINT_RESTART);
+
+   return (result == SQLITE_OK) ? arg : NULL;
+}
+
+/**
+ * Maintains the open index after many updates: the lookup indexes are
+ * rebuilt, the free pages are reclaimed and the statistics used by the
+ * query planner are updated (in sqlite_stat1). The shards are maintained
+ * in parallel.
+ */
+bool index_maintain(void)
+{
+   return run_parallel(maintain_thread, shard_args());
+}
+
+static int index_dbstat_callback(
+   void *pages,
+   int argc,
+   char **argv,
+   char **azColName)
+{
+   if ((argc == 2) && (argv[0] != NULL) && (argv[1] != NULL))
+      (*((map<string, sqlite3_int64> *) pages))[argv[0]] = strtoll(argv[1], NULL, 10);
+   return 0;
+}
+
+/* Writes the sizes of the tables and indexes of a shard to out */
+static void index_report_shard(index_db *db, const char *name, FILE *out)
+{
+   static const char *const tables[] = { "Files", "Cached", "Refs", "Defs", "Decls" };
+   sqlite3_int64 page_size = 0, page_count = 0, freelist = 0, auto_vacuum = 0;
+   sqlite3_int64 entries = 0, cached = 0;
+   map<string, sqlite3_int64> pages;
+   sqlite3_stmt *stmt = NULL;
+   bool have_pages;
+
+   (void) sqlite3_exec(db->index, "PRAGMA page_size", index_int64_callback, &page_size, NULL);
+   (void) sqlite3_exec(db->index, "PRAGMA page_count", index_int64_callback, &page_count, NULL);
+   (void) sqlite3_exec(db->index, "PRAGMA freelist_count", index_int64_callback, &freelist, NULL);
+   (void) sqlite3_exec(db->index, "PRAGMA auto_vacuum", index_int64_callback, &auto_vacuum, NULL);
+
+   /* The pages of each table and index, if SQLite has the dbstat table */
+   have_pages = (sqlite3_exec(db->index,
+                              "SELECT name,count(*) FROM dbstat GROUP BY name",
+                              index_dbstat_callback,
+                              &pages,
+                              NULL) == SQLITE_OK);
+
+   fprintf(out, "%s: %" PRId64 " pages of %" PRId64 " bytes, %" PRId64 " free (%.1f%%)%s\n",
+           name, (int64_t) page_count, (int64_t) page_size, (int64_t) freelist,
+           (page_count > 0) ? 100.0 * freelist / page_count : 0.0,
+           (auto_vacuum == 2) ? "" : ", no incremental vacuum");
+
+   for (size_t i = 0; i < ARRAY_SIZE(tables); i++)
+   {
+      sqlite3_int64 rows = 0, table_cached = 0;
+      char *sql;
+
+      /* The entries of the parse cache have a negative Filerow and are
+       * counted apart from those of the indexed files */
+      if (i > 1)
+      {
+         sql = sqlite3_mprintf("SELECT sum(Filerow>0),sum(Filerow<0) FROM %s", tables[i]);
+         if (sqlite3_prepare_v2(db->index, sql, -1, &stmt, NULL) == SQLITE_OK)
+         {
+            if (sqlite3_step(stmt) == SQLITE_ROW)
+            {
+               rows = sqlite3_column_int64(stmt, 0);
+               table_cached = sqlite3_column_int64(stmt, 1);
+            }
+         }
+         (void) sqlite3_finalize(stmt);
+         stmt = NULL;
+         entries += rows;
+         cached += table_cached;
+      }
+      else
+      {
+         sql = sqlite3_mprintf("SELECT count(*) FROM %s", tables[i]);
+         (void) sqlite3_exec(db->index, sql, index_int64_callback, &rows, NULL);
+      }
+      sqlite3_free(sql);
+
+      if (have_pages)
+      {
+         sqlite3_int64 table_pages = pages[tables[i]];
+
+         fprintf(out, "   %-24s %12" PRId64 " rows %10" PRId64 " pages %8.1f bytes/row\n",
+                 tables[i], (int64_t) rows, (int64_t) table_pages,
+                 (rows + table_cached > 0) ? (double) table_pages * page_size / (rows + table_cached) : 0.0);
+         pages.erase(tables[i]);
+      }
+      else
+      {
+         fprintf(out, "   %-24s %12" PRId64 " rows\n", tables[i], (int64_t) rows);
+      }
+   }
+
+   for (map<string, sqlite3_int64>::iterator it = pages.begin(); it != pages.end(); ++it)
+   {
+      fprintf(out, "   %-24s %17s %10" PRId64 " pages\n", it->first.c_str(), "", (int64_t) it->second);
+   }
+
+   if (entries > 0)
+   {
+      fprintf(out, "   %.1f bytes per entry\n",
+              (double) (page_count - freelist) * page_size / entries);
+   }
+
+   if (cached > 0)
+   {
+      fprintf(out, "   %" PRId64 " cached entries\n", (int64_t) cached);
+   }
+
+   /* The files analyzed in a degraded mode, see check_file_limits() */
+   if (sqlite3_prepare_v2(db->index,
+                          "SELECT Filename,Degraded FROM Files WHERE Degraded<>0 ORDER BY Filename",
+                          -1,
+                          &stmt,
+                          NULL) == SQLITE_OK)
+   {
+      vector<string> degraded;
+
+      while (sqlite3_step(stmt) == SQLITE_ROW)
+      {
+         degraded.push_back(string((const char *) sqlite3_column_text(stmt, 0)) + " (" +
+                            degraded_reasons(sqlite3_column_int(stmt, 1)) + ")");
+      }
+      fprintf(out, "   %d degraded files\n", (int) degraded.size());
+      for (size_t i = 0; i < degraded.size(); i++)
+      {
+         fprintf(out, "      %s\n", degraded[i].c_str());
+      }
+   }
+   (void) sqlite3_finalize(stmt);
+}
+
+/**
+ * Writes the row counts, the page counts, the number of free pages and the
+ * bytes per entry of each shard of the open index to out.
+ */
+void index_report(const char *index_file, FILE *out)
+{
+   if (index_file == NULL)
+   {
+      index_file = "TOKS";
+   }
+
+   for (size_t i = 0; i < cpd.shards.size(); i++)
+   {
+      string name = (cpd.shards.size() > 1) ? shard_filename(index_file, i) : index_file;
+
+      index_report_shard(cpd.shards[i], name.c_str(), out);
+   }
+}
+
+static int index_insert_file(
+   const char *digest,
+   const char *filename,
+   parse_mode mode,
+   int lang_flags,
+   sqlite3_int64 *filerow)
+{
+   int result;
+
+   result = sqlite3_bind_text(cpd.db->stmt_insert_file,
+                              1,
+                              digest,
+                              -1,
+                              SQLITE_STATIC);
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_text(cpd.db->stmt_insert_file,
+                                 2,
+                                 filename,
+                                 -1,
+                                 SQLITE_STATIC);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int(cpd.db->stmt_insert_file,
+                                3,
+                                (int) mode);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int(cpd.db->stmt_insert_file,
+                                4,
+                                lang_flags);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(cpd.db->stmt_insert_file);
+      if (result == SQLITE_DONE)
+      {
+         result = sqlite3_reset(cpd.db->stmt_insert_file);
+      }
+   }
+
+   *filerow = sqlite3_last_insert_rowid(cpd.db->index);
+
+   return result;
+}
+
+static int index_prune_entries(sqlite3_int64 filerow)
+{
+   int result;
+
+   result = sqlite3_bind_int64(cpd.db->stmt_prune_refs,
+                               1,
+                               filerow);
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(cpd.db->stmt_prune_refs);
+      if (result == SQLITE_DONE)
+      {
+         result = sqlite3_reset(cpd.db->stmt_prune_refs);
+      }
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int64(cpd.db->stmt_prune_defs,
+                                  1,
+                                  filerow);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(cpd.db->stmt_prune_defs);
+      if (result == SQLITE_DONE)
+      {
+         result = sqlite3_reset(cpd.db->stmt_prune_defs);
+      }
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int64(cpd.db->stmt_prune_decls,
+                                  1,
+                                  filerow);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(cpd.db->stmt_prune_decls);
+      if (result == SQLITE_DONE)
+      {
+         result = sqlite3_reset(cpd.db->stmt_prune_decls);
+      }
+   }
+
+   return result;
+}
+
+static int index_remove_file(sqlite3_int64 filerow)
+{
+   int result;
+
+   result = sqlite3_bind_int64(cpd.db->stmt_remove_file,
+                               1,
                                filerow);
 
    if (result == SQLITE_OK)
    {
-      result = sqlite3_step(cpd.stmt_remove_file);
-      if (result == SQLITE_DONE)
+      result = sqlite3_step(cpd.db->stmt_remove_file);
+      if (result == SQLITE_DONE)
+      {
+         result = sqlite3_reset(cpd.db->stmt_remove_file);
+      }
+   }
+
+   return result;
+}
+
+/* Inserts an entry of the file bound to the insert statement */
+static int index_insert_row(
+   sqlite3_stmt *stmt_insert_entry,
+   UINT32 line,
+   UINT32 column_start,
+   const char *scope,
+   int type,
+   const char *identifier)
+{
+   int result;
+
+   result = sqlite3_bind_int64(stmt_insert_entry,
+                               2,
+                               line);
+   result |= sqlite3_bind_int64(stmt_insert_entry,
+                                3,
+                                column_start);
+   result |= sqlite3_bind_text(stmt_insert_entry,
+                               4,
+                               scope,
+                               -1,
+                               SQLITE_STATIC);
+   result |= sqlite3_bind_int(stmt_insert_entry,
+                              5,
+                              type);
+   result |= sqlite3_bind_text(stmt_insert_entry,
+                               6,
+                               identifier,
+                               -1,
+                               SQLITE_STATIC);
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(stmt_insert_entry);
+      if (result == SQLITE_DONE)
+      {
+         result = sqlite3_reset(stmt_insert_entry);
+      }
+   }
+
+   return result;
+}
+
+static sqlite3_stmt *index_insert_statement(int sub_type)
+{
+   if (sub_type == IST_DEFINITION)
+      return cpd.db->stmt_insert_definition;
+   else if (sub_type == IST_DECLARATION)
+      return cpd.db->stmt_insert_declaration;
+   return cpd.db->stmt_insert_reference;
+}
+
+/* Runs a statement with two integer parameters, that returns no rows */
+static int index_run(sqlite3_stmt *stmt, sqlite3_int64 a, sqlite3_int64 b)
+{
+   int result;
+
+   result = sqlite3_bind_int64(stmt, 1, a);
+   if ((result == SQLITE_OK) && (sqlite3_bind_parameter_count(stmt) > 1))
+   {
+      result = sqlite3_bind_int64(stmt, 2, b);
+   }
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(stmt);
+      if (result == SQLITE_DONE)
+      {
+         result = sqlite3_reset(stmt);
+      }
+   }
+   (void) sqlite3_reset(stmt);
+
+   return result;
+}
+
+/**
+ * Keeps the entries of a file that is removed or changed in the parse
+ * cache, unless its contents are already there. The entries stay in their
+ * tables with the negated row of the Cached table as Filerow, so lookups
+ * don't see them. Must be called before the file row is changed.
+ */
+static int index_cache_entries(sqlite3_int64 filerow)
+{
+   int result;
+
+   result = index_run(cpd.db->stmt_cache_file, filerow, 0);
+
+   if ((result == SQLITE_OK) && (sqlite3_changes(cpd.db->index) == 0))
+   {
+      return index_prune_entries(filerow);
+   }
+
+   for (int i = 0; (result == SQLITE_OK) && (i < (int) ARRAY_SIZE(cpd.db->stmt_move_entries)); i++)
+   {
+      result = index_run(cpd.db->stmt_move_entries[i],
+                         -sqlite3_last_insert_rowid(cpd.db->index),
+                         filerow);
+   }
+
+   return result;
+}
+
+/* Where the entries of a file with the same contents are */
+struct index_content
+{
+   index_db      *db;
+   sqlite3_int64 filerow;       /* negative for the parse cache */
+   int           mode;
+   int           degraded;
+};
+
+/**
+ * Looks for the entries of another file with the same contents and
+ * language as the file, or of contents in the parse cache, that were
+ * analyzed in a mode that covers the mode of the file. Only entries
+ * degraded by the file limits known before parsing are used, see
+ * check_file_limits(). The shard of the file is searched first.
+ */
+static bool index_find_content(fp_data& fpd, index_content& content)
+{
+   for (size_t i = 0; i <= cpd.shards.size(); i++)
+   {
+      index_db *db = (i == 0) ? cpd.db : cpd.shards[i - 1];
+      sqlite3_stmt *stmt = db->stmt_find_content;
+      int result;
+
+      if ((i > 0) && (db == cpd.db))
+      {
+         continue;
+      }
+
+      result = sqlite3_bind_text(stmt, 1, fpd.digest, -1, SQLITE_STATIC);
+      result |= sqlite3_bind_int(stmt, 2, fpd.lang_flags);
+      result |= sqlite3_bind_int(stmt, 3, (int) fpd.mode);
+      result |= sqlite3_bind_text(stmt, 4, fpd.filename, -1, SQLITE_STATIC);
+      result |= sqlite3_bind_int(stmt, 5, fpd.degraded);
+      if ((result == SQLITE_OK) && (sqlite3_step(stmt) == SQLITE_ROW))
+      {
+         content.db = db;
+         content.filerow = sqlite3_column_int64(stmt, 0);
+         content.mode = sqlite3_column_int(stmt, 1);
+         content.degraded = sqlite3_column_int(stmt, 2);
+         (void) sqlite3_reset(stmt);
+         return true;
+      }
+      (void) sqlite3_reset(stmt);
+   }
+
+   return false;
+}
+
+/**
+ * Gives a file the entries found by index_find_content(). Entries in the
+ * parse cache of the same shard are taken over, the others are copied.
+ * The insert statements must have the file row bound.
+ */
+static int index_reuse_content(fp_data& fpd, const index_content& content)
+{
+   int result = SQLITE_OK;
+
+   if ((content.db == cpd.db) && (content.filerow < 0))
+   {
+      for (int i = 0; (result == SQLITE_OK) && (i < (int) ARRAY_SIZE(cpd.db->stmt_move_entries)); i++)
+      {
+         result = index_run(cpd.db->stmt_move_entries[i], fpd.filerow, content.filerow);
+      }
+      if (result == SQLITE_OK)
+      {
+         result = index_run(cpd.db->stmt_uncache_file, -content.filerow, 0);
+      }
+   }
+   else
+   {
+      /* Not with INSERT ... SELECT, as SQLite copies the rows to a
+       * temporary table first when it reads the table it inserts into */
+      sqlite3_stmt *stmt = content.db->stmt_file_entries;
+
+      /* The entries of a file are found with the location indexes, so they
+       * are created early if the index is being filled from empty */
+      if (content.db->bulk)
+      {
+         result = sqlite3_exec(content.db->index, create_location_indexes, NULL, NULL, NULL);
+         content.db->bulk = false;
+      }
+
+      if (result == SQLITE_OK)
+      {
+         result = sqlite3_bind_int64(stmt, 1, content.filerow);
+      }
+      while ((result == SQLITE_OK) && ((result = sqlite3_step(stmt)) == SQLITE_ROW))
+      {
+         result = index_insert_row(index_insert_statement(sqlite3_column_int(stmt, 6)),
+                                   (UINT32) sqlite3_column_int64(stmt, 1),
+                                   (UINT32) sqlite3_column_int64(stmt, 2),
+                                   (const char *) sqlite3_column_text(stmt, 3),
+                                   sqlite3_column_int(stmt, 4),
+                                   (const char *) sqlite3_column_text(stmt, 5));
+      }
+      if (result == SQLITE_DONE)
+      {
+         result = SQLITE_OK;
+      }
+      (void) sqlite3_reset(stmt);
+   }
+
+   /* The file was analyzed in the mode of the entries */
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int(cpd.db->stmt_degrade_file, 1, content.mode);
+      result |= sqlite3_bind_int(cpd.db->stmt_degrade_file, 2, content.degraded);
+      result |= sqlite3_bind_int(cpd.db->stmt_degrade_file, 3, 0);
+      result |= sqlite3_bind_int(cpd.db->stmt_degrade_file, 4, 0);
+      result |= sqlite3_bind_int64(cpd.db->stmt_degrade_file, 5, fpd.filerow);
+      if (result == SQLITE_OK)
+      {
+         result = sqlite3_step(cpd.db->stmt_degrade_file);
+         if (result == SQLITE_DONE)
+         {
+            result = SQLITE_OK;
+         }
+      }
+      (void) sqlite3_reset(cpd.db->stmt_degrade_file);
+   }
+
+   return result;
+}
+
+/* Drops all but the parse_cache most recently cached contents of a shard */
+static void *trim_cache_thread(void *arg)
+{
+   index_db *db = (index_db *) arg;
+   char *errmsg = NULL;
+   char *sql;
+   int result;
+
+   sql = sqlite3_mprintf(
+      "%s"
+      "CREATE TEMP TABLE Trimmed AS SELECT -rowid AS Filerow FROM Cached "
+      "WHERE rowid NOT IN (SELECT rowid FROM Cached ORDER BY Cached DESC, rowid DESC LIMIT %d);"
+      "DELETE FROM Refs WHERE Filerow<0 AND Filerow IN Trimmed;"
+      "DELETE FROM Defs WHERE Filerow<0 AND Filerow IN Trimmed;"
+      "DELETE FROM Decls WHERE Filerow<0 AND Filerow IN Trimmed;"
+      "DELETE FROM Cached WHERE -rowid IN Trimmed;"
+      "DROP TABLE Trimmed;"
+      "%s",
+      cpd.batch ? "" : "BEGIN;",
+      cpd.parse_cache,
+      cpd.batch ? "" : "COMMIT;");
+
+   result = sqlite3_exec(db->index, sql, NULL, NULL, &errmsg);
+   sqlite3_free(sql);
+
+   if (result != SQLITE_OK)
+   {
+      LOG_FMT(LERR, "index_trim_cache: access error (%d: %s)\n", result, errmsg != NULL ? errmsg : "");
+      if (!cpd.batch)
+      {
+         (void) sqlite3_exec(db->index, "ROLLBACK", NULL, NULL, NULL);
+      }
+   }
+   sqlite3_free(errmsg);
+
+   return (result == SQLITE_OK) ? arg : NULL;
+}
+
+/**
+ * Drops the contents in the parse cache of the shards beyond the
+ * --parse-cache most recently cached ones, at the end of an update.
+ */
+bool index_trim_cache(void)
+{
+   return run_parallel(trim_cache_thread, shard_args());
+}
+
+struct prune_check
+{
+   const vector<string> *filenames;
+   vector<char>         *missing;
+   int                  next;
+};
+
+static void *prune_check_thread(void *arg)
+{
+   prune_check *check = (prune_check *) arg;
+   int i;
+
+   while ((i = __sync_fetch_and_add(&check->next, 1)) < (int) check->filenames->size())
+   {
+      (*check->missing)[i] = !file_exists((*check->filenames)[i].c_str());
+   }
+   return NULL;
+}
+
+/* Checks which of the files exist, with up to cpd.threads threads */
+static void prune_check_files(const vector<string>& filenames, vector<char>& missing)
+{
+   prune_check check = { &filenames, &missing, 0 };
+
+   missing.resize(filenames.size());
+
+#ifndef WIN32
+   vector<pthread_t> threads;
+   int count = (int) ((filenames.size() + 255) / 256);
+
+   if (count > cpd.threads)
+   {
+      count = cpd.threads;
+   }
+   for (int i = 1; i < count; i++)
+   {
+      pthread_t thread;
+
+      if (pthread_create(&thread, NULL, prune_check_thread, &check) == 0)
+      {
+         threads.push_back(thread);
+      }
+   }
+   (void) prune_check_thread(&check);
+   for (size_t i = 0; i < threads.size(); i++)
+   {
+      pthread_join(threads[i], NULL);
+   }
+#else
+   (void) prune_check_thread(&check);
+#endif
+}
+
+/**
+ * Keeps the entries of the files in the Pruned table in the parse cache of
+ * cpd.db, in case the files were moved, one file for each contents that is
+ * not cached yet. The new Cached rows get the rowid of the file plus the
+ * largest rowid before, so the entries are moved with one statement per
+ * table. The entries of the other files are left to be deleted.
+ */
+static int index_cache_pruned(void)
+{
+   sqlite3_int64 base = 0;
+   char *sql;
+   int result;
+
+   result = sqlite3_exec(cpd.db->index,
+                         "SELECT ifnull(max(rowid),0) FROM Cached",
+                         index_int64_callback,
+                         &base,
+                         NULL);
+
+   if (result == SQLITE_OK)
+   {
+      sql = sqlite3_mprintf(
+         "INSERT INTO Cached(rowid,Digest,Lang,Mode,Degraded,Cached) "
+         "SELECT %lld+min(p.Filerow),f.Digest,f.Lang,f.Mode,f.Degraded,strftime('%%s','now') "
+         "FROM Pruned AS p JOIN Files AS f ON f.rowid=p.Filerow "
+         "WHERE NOT EXISTS (SELECT 1 FROM Cached AS c "
+         "WHERE c.Digest=f.Digest AND c.Lang=f.Lang AND c.Mode=f.Mode AND c.Degraded=f.Degraded) "
+         "GROUP BY f.Digest,f.Lang,f.Mode,f.Degraded",
+         base);
+      result = sqlite3_exec(cpd.db->index, sql, NULL, NULL, NULL);
+      sqlite3_free(sql);
+   }
+
+   for (int i = 0; (result == SQLITE_OK) && (i < (int) ARRAY_SIZE(lookup_tables)); i++)
+   {
+      sql = sqlite3_mprintf("UPDATE %s SET Filerow=-(Filerow+%lld) "
+                            "WHERE Filerow IN (SELECT rowid-%lld FROM Cached WHERE rowid>%lld)",
+                            lookup_tables[i], base, base, base);
+      result = sqlite3_exec(cpd.db->index, sql, NULL, NULL, NULL);
+      sqlite3_free(sql);
+   }
+
+   return result;
+}
+
+/**
+ * Removes the files that no longer exist from the shard cpd.db.
+ * The files are checked in parallel, and the rows of the missing files are
+ * collected in a temporary table, moved to the parse cache and deleted with
+ * one statement per table.
+ */
+static bool index_prune_shard(void)
+{
+   int result;
+   bool retval = true;
+   sqlite3_stmt *stmt_iterate_files;
+   sqlite3_stmt *stmt_insert_pruned = NULL;
+   vector<sqlite3_int64> filerows;
+   vector<string> filenames;
+   vector<char> missing;
+   int pruned = 0;
+
+   result = sqlite3_prepare_v2(cpd.db->index,
+                               "SELECT rowid,Filename FROM Files",
+                               -1,
+                               &stmt_iterate_files,
+                               NULL);
+
+   if (result == SQLITE_OK)
+   {
+      while ((result = sqlite3_step(stmt_iterate_files)) == SQLITE_ROW)
+      {
+         const char *filename = (const char *) sqlite3_column_text(stmt_iterate_files, 1);
+
+         /* Files of other partitions are left to their own runs */
+         if (index_in_partition(filename))
+         {
+            filerows.push_back(sqlite3_column_int64(stmt_iterate_files, 0));
+            filenames.push_back(filename);
+         }
+      }
+      if (result == SQLITE_DONE)
+      {
+         result = SQLITE_OK;
+      }
+   }
+
+   (void) sqlite3_finalize(stmt_iterate_files);
+
+   if (result == SQLITE_OK)
+   {
+      prune_check_files(filenames, missing);
+
+      result = sqlite3_exec(cpd.db->index,
+                            "CREATE TEMP TABLE IF NOT EXISTS Pruned(Filerow INTEGER PRIMARY KEY);"
+                            "DELETE FROM Pruned;",
+                            NULL,
+                            NULL,
+                            NULL);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_prepare_v2(cpd.db->index,
+                                  "INSERT INTO Pruned VALUES(?)",
+                                  -1,
+                                  &stmt_insert_pruned,
+                                  NULL);
+   }
+
+   for (size_t i = 0; (result == SQLITE_OK) && (i < filerows.size()); i++)
+   {
+      if (missing[i])
+      {
+         LOG_FMT(LNOTE, "File %s at filerow %" PRId64 " does not exist, removed from index\n", filenames[i].c_str(), (int64_t) filerows[i]);
+         result = sqlite3_bind_int64(stmt_insert_pruned, 1, filerows[i]);
+         if (result == SQLITE_OK)
+         {
+            result = sqlite3_step(stmt_insert_pruned);
+            if (result == SQLITE_DONE)
+            {
+               result = sqlite3_reset(stmt_insert_pruned);
+            }
+         }
+         pruned++;
+      }
+   }
+
+   (void) sqlite3_finalize(stmt_insert_pruned);
+
+   /* A savepoint, so a failure also leaves a batch as it was: entries
+    * moved to the parse cache without their file being removed would
+    * never be indexed again */
+   if ((result == SQLITE_OK) && (pruned > 0))
+   {
+      result = sqlite3_exec(cpd.db->index, "SAVEPOINT Prune", NULL, NULL, NULL);
+
+      if (result == SQLITE_OK)
+      {
+         result = index_cache_pruned();
+      }
+
+      if (result == SQLITE_OK)
+      {
+         result = sqlite3_exec(cpd.db->index,
+                               "DELETE FROM Refs WHERE Filerow IN (SELECT Filerow FROM Pruned);"
+                               "DELETE FROM Defs WHERE Filerow IN (SELECT Filerow FROM Pruned);"
+                               "DELETE FROM Decls WHERE Filerow IN (SELECT Filerow FROM Pruned);"
+                               "DELETE FROM Files WHERE rowid IN (SELECT Filerow FROM Pruned);",
+                               NULL,
+                               NULL,
+                               NULL);
+      }
+
+      if (result == SQLITE_OK)
+      {
+         result = sqlite3_exec(cpd.db->index, "RELEASE Prune", NULL, NULL, NULL);
+      }
+      else if (!sqlite3_get_autocommit(cpd.db->index))
+      {
+         (void) sqlite3_exec(cpd.db->index, "ROLLBACK TO Prune; RELEASE Prune", NULL, NULL, NULL);
+      }
+   }
+
+   if (result != SQLITE_OK)
+   {
+      const char *errstr = sqlite3_errstr(result);
+      LOG_FMT(LERR, "index_prune_files: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      retval = false;
+   }
+
+   return retval;
+}
+
+/* Removes the files that no longer exist from all shards */
+bool index_prune_files(void)
+{
+   bool retval = true;
+
+   stats_phase_begin(SP_INDEX_PRUNE);
+
+   for (size_t i = 0; retval && (i < cpd.shards.size()); i++)
+   {
+      cpd.db = cpd.shards[i];
+      retval = index_prune_shard();
+   }
+
+   stats_phase_end(SP_INDEX_PRUNE);
+
+   return retval;
+}
+
+static int index_replace_file(const char *digest, const char *filename, parse_mode mode, int lang_flags)
+{
+   int result;
+
+   result = sqlite3_bind_text(cpd.db->stmt_change_digest,
+                              1,
+                              digest,
+                              -1,
+                              SQLITE_STATIC);
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int(cpd.db->stmt_change_digest,
+                                2,
+                                (int) mode);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_text(cpd.db->stmt_change_digest,
+                                 3,
+                                 filename,
+                                 -1,
+                                 SQLITE_STATIC);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int(cpd.db->stmt_change_digest,
+                                4,
+                                lang_flags);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(cpd.db->stmt_change_digest);
+      if (result == SQLITE_DONE)
+      {
+         result = sqlite3_reset(cpd.db->stmt_change_digest);
+      }
+   }
+
+   return result;
+}
+
+/**
+ * Begins a transaction for the changes of a file whose entries are reused,
+ * as the file is not analyzed. Returns true if it has to be committed.
+ */
+static bool index_begin_reuse(void)
+{
+   if (cpd.batch || cpd.db->wal || !sqlite3_get_autocommit(cpd.db->index))
+   {
+      return false;
+   }
+   (void) sqlite3_reset(cpd.db->stmt_begin);
+   (void) sqlite3_step(cpd.db->stmt_begin);
+   return true;
+}
+
+/* The --max-parse-time limit in milliseconds, as stored in Files */
+static UINT32 max_parse_time_ms(void)
+{
+   return (UINT32) (cpd.max_parse_time * 1000.0 + 0.5);
+}
+
+/**
+ * Checks if an unchanged file that was degraded would be degraded again.
+ * The file limits have been checked again already. A file with more tokens
+ * than max_tokens, or that took longer than max_parse_time, exceeds any
+ * lower limit, so it is only analyzed again if its limit was raised or
+ * removed.
+ */
+static bool index_still_degraded(
+   const fp_data& fpd,
+   int degraded,
+   UINT32 max_tokens,
+   UINT32 max_parse_time)
+{
+   const int file_limits = DR_FILE_SIZE | DR_LINE_LENGTH;
+
+   if (degraded == DR_NONE)
+   {
+      return false;
+   }
+   if (((degraded & DR_TOKENS) != 0) &&
+       ((cpd.max_tokens == 0) || (cpd.max_tokens > max_tokens)))
+   {
+      return false;
+   }
+   if (((degraded & DR_PARSE_TIME) != 0) &&
+       ((cpd.max_parse_time <= 0) || (max_parse_time_ms() > max_parse_time)))
+   {
+      return false;
+   }
+   return (degraded & file_limits) == (fpd.degraded & file_limits);
+}
+
+/* Returns true if the file needs to be analyzed */
+bool index_prepare_for_file(fp_data& fpd)
+{
+   int result;
+   bool retval = true;
+   sqlite3_int64 filerow = 0;
+   index_content content;
+   bool reuse = false, begun = false;
+
+   cpd.db = index_shard(fpd.filename);
+
+   /* With WAL, a transaction covers a group of files, including their
+    * removal from the index, as each commit writes to the WAL */
+   if (cpd.db->wal && !cpd.batch && sqlite3_get_autocommit(cpd.db->index))
+   {
+      (void) sqlite3_reset(cpd.db->stmt_begin);
+      (void) sqlite3_step(cpd.db->stmt_begin);
+   }
+
+   result = sqlite3_bind_text(cpd.db->stmt_lookup_file,
+                              1,
+                              fpd.filename,
+                              -1,
+                              SQLITE_STATIC);
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(cpd.db->stmt_lookup_file);
+   }
+
+   if (result == SQLITE_ROW)
+   {
+      filerow = sqlite3_column_int64(cpd.db->stmt_lookup_file, 0);
+      const char *ingest =
+         (const char *) sqlite3_column_text(cpd.db->stmt_lookup_file, 1);
+      parse_mode inmode =
+         (parse_mode) sqlite3_column_int(cpd.db->stmt_lookup_file, 2);
+      int indegraded = sqlite3_column_int(cpd.db->stmt_lookup_file, 3);
+      UINT32 inmax_tokens = (UINT32) sqlite3_column_int64(cpd.db->stmt_lookup_file, 4);
+      UINT32 inmax_parse_time = (UINT32) sqlite3_column_int64(cpd.db->stmt_lookup_file, 5);
+
+      /* A file analyzed in full covers any other mode, and a degraded file
+       * would just be degraded again while its limits still apply */
+      if ((strcmp(fpd.digest, ingest) == 0) &&
+          ((inmode == PM_FULL) || (inmode == fpd.mode) ||
+           index_still_degraded(fpd, indegraded, inmax_tokens, inmax_parse_time)))
+      {
+         LOG_FMT(LNOTE, "File %s(%s) exists in index at filerow %" PRId64 " with same digest\n", fpd.filename, fpd.digest, (int64_t) filerow);
+         result = SQLITE_OK;
+         retval = false;
+      }
+      else
+      {
+         LOG_FMT(LNOTE, "File %s(%s) exists in index at filerow %" PRId64 " with different digest (%s) or mode (%d)\n", fpd.filename, fpd.digest, (int64_t) filerow, ingest, (int) inmode);
+         reuse = index_find_content(fpd, content);
+         begun = reuse && index_begin_reuse();
+
+         /* Unless the old entries are kept in the parse cache, they are
+          * updated to the new ones in index_end_file() */
+         if (cpd.parse_cache > 0)
+         {
+            result = index_cache_entries(filerow);
+         }
+         else if (reuse)
+         {
+            result = index_prune_entries(filerow);
+         }
+         else
+         {
+            fpd.delta = true;
+            result = SQLITE_OK;
+         }
+
+         if (result == SQLITE_OK)
+         {
+            result = index_replace_file(fpd.digest, fpd.filename, fpd.mode, fpd.lang_flags);
+         }
+      }
+   }
+   else if (result == SQLITE_DONE)
+   {
+      reuse = index_find_content(fpd, content);
+      begun = reuse && index_begin_reuse();
+      result = index_insert_file(fpd.digest, fpd.filename, fpd.mode, fpd.lang_flags, &filerow);
+      LOG_FMT(LNOTE, "File %s(%s) does not exist in index, inserted at filerow %" PRId64 "\n", fpd.filename, fpd.digest, (int64_t) filerow);
+   }
+
+   (void) sqlite3_reset(cpd.db->stmt_lookup_file);
+   fpd.filerow = filerow;
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int64(cpd.db->stmt_insert_reference,
+                                  1,
+                                  filerow);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int64(cpd.db->stmt_insert_definition,
+                                  1,
+                                  filerow);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int64(cpd.db->stmt_insert_declaration,
+                                  1,
+                                  filerow);
+   }
+
+   /* The file doesn't have to be analyzed if its contents are known */
+   if ((result == SQLITE_OK) && reuse)
+   {
+      LOG_FMT(LNOTE, "File %s(%s) has the entries at filerow %" PRId64 "\n", fpd.filename, fpd.digest, (int64_t) content.filerow);
+      result = index_reuse_content(fpd, content);
+      retval = false;
+   }
+
+   if (begun)
+   {
+      (void) index_commit_group(cpd.db);
+   }
+
+   if (result != SQLITE_OK)
+   {
+      const char *errstr = sqlite3_errstr(result);
+      LOG_FMT(LERR, "index_prepare_for_file: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      retval = false;
+   }
+
+   return retval;
+}
+
+/**
+ * Removes a file and its entries from the index, if it is there.
+ */
+bool index_remove_filename(const char *filename)
+{
+   int result;
+   bool retval = true;
+
+   cpd.db = index_shard(filename);
+
+   result = sqlite3_bind_text(cpd.db->stmt_lookup_file,
+                              1,
+                              filename,
+                              -1,
+                              SQLITE_STATIC);
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(cpd.db->stmt_lookup_file);
+   }
+
+   if (result == SQLITE_ROW)
+   {
+      sqlite3_int64 filerow = sqlite3_column_int64(cpd.db->stmt_lookup_file, 0);
+
+      LOG_FMT(LNOTE, "File %s at filerow %" PRId64 " was removed, removed from index\n", filename, (int64_t) filerow);
+      result = index_cache_entries(filerow);
+      if (result == SQLITE_OK)
+      {
+         result = index_remove_file(filerow);
+      }
+   }
+   else if (result == SQLITE_DONE)
+   {
+      result = SQLITE_OK;
+   }
+
+   if (result != SQLITE_OK)
+   {
+      const char *errstr = sqlite3_errstr(result);
+      LOG_FMT(LERR, "index_remove_filename: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      retval = false;
+   }
+
+   (void) sqlite3_reset(cpd.db->stmt_lookup_file);
+
+   return retval;
+}
+
+static void *commit_thread(void *arg)
+{
+   return index_commit_group((index_db *) arg) ? arg : NULL;
+}
+
+/**
+ * Groups the updates of several files in one transaction, instead of a
+ * transaction per file. Must be matched by index_end_batch().
+ * Each shard has its own transaction, they are committed in parallel.
+ */
+void index_begin_batch(void)
+{
+   for (size_t i = 0; i < cpd.shards.size(); i++)
+   {
+      (void) sqlite3_reset(cpd.shards[i]->stmt_begin);
+      (void) sqlite3_step(cpd.shards[i]->stmt_begin);
+   }
+   cpd.batch = true;
+}
+
+void index_end_batch(void)
+{
+   stats_phase_begin(SP_INDEX_COMMIT);
+   cpd.batch = false;
+   (void) run_parallel(commit_thread, shard_args());
+   stats_phase_end(SP_INDEX_COMMIT);
+}
+
+void index_begin_file(fp_data& fpd)
+{
+   trace_begin("index_begin_file");
+   if (!cpd.batch && sqlite3_get_autocommit(cpd.db->index))
+   {
+      (void) sqlite3_reset(cpd.db->stmt_begin);
+      (void) sqlite3_step(cpd.db->stmt_begin);
+   }
+
+   /* Record the mode the file was actually analyzed in */
+   if (fpd.degraded != DR_NONE)
+   {
+      int result;
+
+      result = sqlite3_bind_int(cpd.db->stmt_degrade_file, 1, (int) fpd.mode);
+      result |= sqlite3_bind_int(cpd.db->stmt_degrade_file, 2, fpd.degraded);
+      result |= sqlite3_bind_int64(cpd.db->stmt_degrade_file, 3,
+                                   ((fpd.degraded & DR_TOKENS) != 0) ? cpd.max_tokens : 0);
+      result |= sqlite3_bind_int64(cpd.db->stmt_degrade_file, 4,
+                                   ((fpd.degraded & DR_PARSE_TIME) != 0) ? max_parse_time_ms() : 0);
+      result |= sqlite3_bind_int64(cpd.db->stmt_degrade_file, 5, fpd.filerow);
+      if (result == SQLITE_OK)
+      {
+         result = sqlite3_step(cpd.db->stmt_degrade_file);
+      }
+      if (result != SQLITE_DONE)
+      {
+         const char *errstr = sqlite3_errstr(result);
+         LOG_FMT(LERR, "index_begin_file: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      }
+      (void) sqlite3_reset(cpd.db->stmt_degrade_file);
+   }
+   trace_end("index_begin_file");
+}
+
+/* The order of the entries of a file */
+static bool entry_before(const index_entry& a, const index_entry& b)
+{
+   if (a.line != b.line)
+      return a.line < b.line;
+   if (a.column != b.column)
+      return a.column < b.column;
+   return a.sub_type < b.sub_type;
+}
+
+/* The entries are the same, except maybe for their position */
+static bool entry_same(const index_entry& a, const index_entry& b)
+{
+   return (a.sub_type == b.sub_type) && (a.type == b.type) &&
+          (a.identifier == b.identifier) && (a.scope == b.scope);
+}
+
+static string entry_key(const index_entry& e)
+{
+   char prefix[32];
+
+   snprintf(prefix, sizeof(prefix), "%d:%d:", e.sub_type, e.type);
+   return prefix + e.scope + '\0' + e.identifier;
+}
+
+/**
+ * Replaces the entries of a changed file in the index with the new ones in
+ * fpd.entries, by writing only the differences. The new entries are
+ * matched with the old ones that are the same except for their position:
+ * first the unchanged entries before the first change, then the entries
+ * after the last change, which may have moved, and then the entries in
+ * between in order. Old entries that are not matched are deleted, matched
+ * entries that moved are updated and the rest of the new ones inserted.
+ */
+static bool index_apply_delta(fp_data& fpd)
+{
+   vector<index_entry> old_entries;
+   vector<index_entry>& new_entries = fpd.entries;
+   vector<int> match(new_entries.size(), -1);
+   vector<bool> matched;
+   size_t first = 0, old_end, new_end;
+   int deleted = 0, moved = 0, inserted = 0;
+   int result;
+
+   result = sqlite3_bind_int64(cpd.db->stmt_file_entries, 1, fpd.filerow);
+   while ((result == SQLITE_OK) || (result == SQLITE_ROW))
+   {
+      result = sqlite3_step(cpd.db->stmt_file_entries);
+      if (result == SQLITE_ROW)
+      {
+         const char *scope = (const char *) sqlite3_column_text(cpd.db->stmt_file_entries, 3);
+         const char *identifier = (const char *) sqlite3_column_text(cpd.db->stmt_file_entries, 5);
+         index_entry entry =
+         {
+            sqlite3_column_int64(cpd.db->stmt_file_entries, 0),
+            (UINT32) sqlite3_column_int64(cpd.db->stmt_file_entries, 1),
+            (UINT32) sqlite3_column_int64(cpd.db->stmt_file_entries, 2),
+            sqlite3_column_int(cpd.db->stmt_file_entries, 4),
+            sqlite3_column_int(cpd.db->stmt_file_entries, 6),
+            (scope != NULL) ? scope : "",
+            (identifier != NULL) ? identifier : "",
+         };
+         old_entries.push_back(entry);
+      }
+   }
+   (void) sqlite3_reset(cpd.db->stmt_file_entries);
+   if (result == SQLITE_DONE)
+   {
+      result = SQLITE_OK;
+   }
+
+   std::sort(old_entries.begin(), old_entries.end(), entry_before);
+   std::stable_sort(new_entries.begin(), new_entries.end(), entry_before);
+   matched.resize(old_entries.size(), false);
+
+   /* The unchanged entries before the first change */
+   while ((first < old_entries.size()) && (first < new_entries.size()) &&
+          entry_same(old_entries[first], new_entries[first]) &&
+          (old_entries[first].line == new_entries[first].line) &&
+          (old_entries[first].column == new_entries[first].column))
+   {
+      match[first] = first;
+      matched[first] = true;
+      first++;
+   }
+
+   /* The entries after the last change */
+   old_end = old_entries.size();
+   new_end = new_entries.size();
+   while ((old_end > first) && (new_end > first) &&
+          entry_same(old_entries[old_end - 1], new_entries[new_end - 1]))
+   {
+      old_end--;
+      new_end--;
+      match[new_end] = old_end;
+      matched[old_end] = true;
+   }
+
+   /* The entries in between, in order */
+   if ((first < old_end) && (first < new_end))
+   {
+      map<string, deque<size_t> > unmatched;
+
+      for (size_t i = first; i < old_end; i++)
+      {
+         unmatched[entry_key(old_entries[i])].push_back(i);
+      }
+      for (size_t i = first; i < new_end; i++)
+      {
+         map<string, deque<size_t> >::iterator it = unmatched.find(entry_key(new_entries[i]));
+
+         if ((it != unmatched.end()) && !it->second.empty())
+         {
+            match[i] = it->second.front();
+            matched[match[i]] = true;
+            it->second.pop_front();
+         }
+      }
+   }
+
+   for (size_t i = 0; (result == SQLITE_OK) && (i < old_entries.size()); i++)
+   {
+      if (!matched[i])
+      {
+         sqlite3_stmt *stmt = cpd.db->stmt_delete_entry[old_entries[i].sub_type];
+
+         result = sqlite3_bind_int64(stmt, 1, old_entries[i].rowid);
+         if (result == SQLITE_OK)
+         {
+            result = sqlite3_step(stmt);
+            if (result == SQLITE_DONE)
+            {
+               result = sqlite3_reset(stmt);
+            }
+         }
+         deleted++;
+      }
+   }
+
+   for (size_t i = 0; (result == SQLITE_OK) && (i < new_entries.size()); i++)
+   {
+      const index_entry& entry = new_entries[i];
+
+      if (match[i] < 0)
+      {
+         result = index_insert_row(index_insert_statement(entry.sub_type),
+                                   entry.line,
+                                   entry.column,
+                                   entry.scope.c_str(),
+                                   entry.type,
+                                   entry.identifier.c_str());
+         inserted++;
+      }
+      else if ((old_entries[match[i]].line != entry.line) ||
+               (old_entries[match[i]].column != entry.column))
+      {
+         sqlite3_stmt *stmt = cpd.db->stmt_move_entry[entry.sub_type];
+
+         result = sqlite3_bind_int64(stmt, 1, entry.line);
+         result |= sqlite3_bind_int64(stmt, 2, entry.column);
+         result |= sqlite3_bind_int64(stmt, 3, old_entries[match[i]].rowid);
+         if (result == SQLITE_OK)
+         {
+            result = sqlite3_step(stmt);
+            if (result == SQLITE_DONE)
+            {
+               result = sqlite3_reset(stmt);
+            }
+         }
+         moved++;
+      }
+   }
+
+   LOG_FMT(LNOTE, "File %s: %d entries, %d deleted, %d moved, %d inserted\n",
+           fpd.filename, (int) new_entries.size(), deleted, moved, inserted);
+
+   fpd.entries.clear();
+
+   if (result != SQLITE_OK)
+   {
+      const char *errstr = sqlite3_errstr(result);
+      LOG_FMT(LERR, "index_apply_delta: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      return false;
+   }
+
+   return true;
+}
+
+void index_end_file(fp_data& fpd)
+{
+   if (fpd.delta)
+   {
+      stats_phase_begin(SP_INDEX_INSERT);
+      (void) index_apply_delta(fpd);
+      stats_phase_end(SP_INDEX_INSERT);
+   }
+
+   if (cpd.batch)
+   {
+      return;
+   }
+
+   /* With WAL, the files are committed in groups, see index_prepare_for_file() */
+   if (cpd.db->wal && (++cpd.db->group_files < WAL_GROUP_FILES))
+   {
+      return;
+   }
+
+   stats_phase_begin(SP_INDEX_COMMIT);
+   (void) index_commit_group(cpd.db);
+   stats_phase_end(SP_INDEX_COMMIT);
+}
+
+bool index_insert_entry(
+   fp_data& fpd,
+   UINT32 line,
+   UINT32 column_start,
+   const char *scope,
+   id_type type,
+   id_sub_type sub_type,
+   const char *identifier)
+{
+   bool retval = true;
+   int result;
+
+   stats_add_entry();
+
+   /* The entries of a changed file are written by index_apply_delta() */
+   if (fpd.delta)
+   {
+      index_entry entry = { 0, line, column_start, (int) type, (int) sub_type, scope, identifier };
+
+      fpd.entries.push_back(entry);
+      return true;
+   }
+
+   stats_phase_begin(SP_INDEX_INSERT);
+
+   result = index_insert_row(index_insert_statement(sub_type),
+                             line,
+                             column_start,
+                             scope,
+                             (int) type,
+                             identifier);
+
+   stats_phase_end(SP_INDEX_INSERT);
+
+   if (result != SQLITE_OK)
+   {
+      const char *errstr = sqlite3_errstr(result);
+      LOG_FMT(LERR, "index_insert_entry: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      retval = false;
+   }
+
+   return retval;
+}
+
+/* The order of the kinds with defs_first */
+static const id_sub_type lookup_rank[] =
+{
+   IST_DEFINITION,
+   IST_DECLARATION,
+   IST_REFERENCE,
+};
+
+/**
+ * Builds the query that looks up identifiers in the tables of the kinds,
+ * (1 << id_sub_type). The identifier is either the pattern bound to ?1 or,
+ * if names is set, each name in the temporary Names table. The matches are
+ * ordered by name, by how well their scope matches the scope bound to ?7
+ * if context_scope is set, by distance from the file bound to ?3 if near
+ * is set, and by location. ?2 is the maximum number of matches.
+ * The filters of the options are added to each table's WHERE clause, so
+ * the (Identifier, Type) indexes and the Filename index can be used:
+ * ?4 is the types mask, ?5 the scope pattern, ?6 the pattern of the paths
+ * below the directory and ?8 the file or directory itself.
+ * The keys the matches are ordered by before the location are the last
+ * LOOKUP_KEYS columns, so the matches of several shards can be merged.
+ * No index provides this order, as the location starts with the file name
+ * and the matches span the tables and, for a pattern, several identifiers.
+ * SQLite sorts all matches and keeps the best ?2, so a limit saves the
+ * output but not reading the matches.
+ */
+static string lookup_sql(UINT32 kinds, bool names, const lookup_options& options)
+{
+   string sql = "SELECT Files.Filename,e.Line,e.ColumnStart,e.Scope,e.Type,e.Identifier,e.SubType,e.Seq,";
+   string filters;
+   bool first = true;
+
+   if (options.types != 0)
+   {
+      filters += " AND ((1<<t.Type)&?4)!=0";
+   }
+   if (options.scope != NULL)
+   {
+      filters += " AND t.Scope GLOB ?5";
+   }
+   if (options.path != NULL)
+   {
+      filters += " AND t.Filerow IN (SELECT rowid FROM Files WHERE Filename=?8 OR Filename GLOB ?6)";
+   }
+
+   sql += (options.context_scope != NULL) ? "ScopeDistance(e.Scope,?7)," : "0,";
+   if ((names && options.defs_first) || (options.context_scope != NULL))
+   {
+      char rank[128];
+
+      snprintf(rank, sizeof(rank), "CASE e.SubType WHEN %d THEN 0 WHEN %d THEN 1 ELSE 2 END,",
+               lookup_rank[0], lookup_rank[1]);
+      sql += rank;
+   }
+   else
+   {
+      sql += "0,";
+   }
+   sql += (options.near != NULL) ? "PathDistance(Files.Filename,?3) FROM (" : "0 FROM (";
+
+   for (int i = 0; i < (int) ARRAY_SIZE(lookup_tables); i++)
+   {
+      if (kinds & (1U << i))
+      {
+         char select[256];
+
+         snprintf(select, sizeof(select),
+                  "%sSELECT t.Filerow,t.Line,t.ColumnStart,t.Scope,t.Type,t.Identifier,%d AS SubType,%s AS Seq "
+                  "FROM %s AS t %s",
+                  first ? "" : " UNION ALL ", i, names ? "n.Seq" : "0", lookup_tables[i],
+                  names ? "JOIN Names AS n ON n.Name=t.Identifier WHERE 1" : "WHERE t.Identifier GLOB ?1");
+         sql += select;
+         sql += filters;
+         first = false;
+      }
+   }
+   sql += ") AS e JOIN Files ON Files.rowid=e.Filerow "
+          "ORDER BY 8,9,10,11,Files.Filename,e.Line,e.ColumnStart,e.SubType DESC LIMIT ?2";
+
+   return sql;
+}
+
+/**
+ * Gets the statement that looks up an identifier pattern in the tables of
+ * the kinds with one query. The statements are prepared the first time
+ * they are used and kept in the cache, which has a statement for each
+ * combination of kinds and options that change the query.
+ */
+static int lookup_statement(
+   sqlite3 *index,
+   sqlite3_stmt **cache,
+   UINT32 kinds,
+   const lookup_options& options,
+   sqlite3_stmt **stmt)
+{
+   int key = kinds |
+             ((options.near != NULL) ? 0x08 : 0) |
+             ((options.types != 0) ? 0x10 : 0) |
+             ((options.scope != NULL) ? 0x20 : 0) |
+             ((options.path != NULL) ? 0x40 : 0) |
+             ((options.context_scope != NULL) ? 0x80 : 0);
+   int result = SQLITE_OK;
+
+   if (cache[key] == NULL)
+   {
+      result = sqlite3_prepare_v2(index,
+                                  lookup_sql(kinds, false, options).c_str(),
+                                  -1,
+                                  &cache[key],
+                                  NULL);
+   }
+
+   *stmt = cache[key];
+   return result;
+}
+
+/* Makes a pattern that only matches str */
+static string glob_escape(const char *str)
+{
+   string pattern;
+
+   for (; *str != 0; str++)
+   {
+      if ((*str == '*') || (*str == '?') || (*str == '['))
+      {
+         pattern += '[';
+         pattern += *str;
+         pattern += ']';
+      }
+      else
+      {
+         pattern += *str;
+      }
+   }
+
+   return pattern;
+}
+
+/* The directory or file given with --in, without trailing slashes */
+static string path_prefix(const char *path)
+{
+   string prefix(path);
+
+   while ((prefix.size() > 1) && (prefix[prefix.size() - 1] == '/'))
+   {
+      prefix.erase(prefix.size() - 1);
+   }
+   return prefix;
+}
+
+/* Makes a pattern that matches the paths below the directory prefix */
+static string path_pattern(const char *path)
+{
+   string prefix = path_prefix(path);
+
+   if (prefix != "/")
+   {
+      prefix = glob_escape(prefix.c_str()) + "/";
+   }
+   return prefix + "*";
+}
+
+#define LOOKUP_KEYS 4
+
+/* A match of a lookup in a shard, with the keys it is ordered by */
+struct lookup_match
+{
+   sqlite3_int64 keys[LOOKUP_KEYS];
+   string        filename;
+   UINT32        line;
+   UINT32        column_start;
+   string        scope;
+   id_type       type;
+   id_sub_type   sub_type;
+   string        identifier;
+};
+
+/* Outputs a match to stdout, or appends it to out if it is not NULL */
+static void lookup_output(
+   string *out,
+   const char *filename,
+   UINT32 line,
+   UINT32 column_start,
+   const char *scope,
+   id_type type,
+   id_sub_type sub_type,
+   const char *identifier)
+{
+   if (out != NULL)
+   {
+      format_identifier(
+         *out,
+         OF_TEXT,
+         filename,
+         line,
+         column_start,
+         scope,
+         type,
+         sub_type,
+         identifier);
+   }
+   else
+   {
+      output_identifier(
+         filename,
+         line,
+         column_start,
+         scope,
+         type,
+         sub_type,
+         identifier);
+   }
+}
+
+/**
+ * Runs a lookup statement and outputs the matches to stdout, or appends
+ * them to out if it is not NULL, or adds them to matches if it is not NULL.
+ * The statement is limited to the matches needed for the limit and offset
+ * of the options, which are decremented by the number of matches output
+ * and skipped, so they can be carried over to the next statement.
+ *
+ * @param identifier  The pattern, NULL for a lookup of the Names table
+ */
+static int index_lookup_run(
+   sqlite3_stmt *stmt_lookup_identifier,
+   const char *identifier,
+   lookup_options& options,
+   string *out,
+   vector<lookup_match> *matches)
+{
+   int result = SQLITE_OK;
+
+   if (identifier != NULL)
+   {
+      result = sqlite3_bind_text(stmt_lookup_identifier,
+                                 1,
+                                 identifier,
+                                 -1,
+                                 SQLITE_STATIC);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int64(stmt_lookup_identifier,
+                                  2,
+                                  (options.limit < 0) ? -1 : (sqlite3_int64) options.limit + options.offset);
+   }
+
+   if ((result == SQLITE_OK) && (options.near != NULL))
+   {
+      result = sqlite3_bind_text(stmt_lookup_identifier,
+                                 3,
+                                 options.near,
+                                 -1,
+                                 SQLITE_STATIC);
+   }
+
+   if ((result == SQLITE_OK) && (options.types != 0))
+   {
+      result = sqlite3_bind_int64(stmt_lookup_identifier,
+                                  4,
+                                  options.types);
+   }
+
+   if ((result == SQLITE_OK) && (options.scope != NULL))
+   {
+      result = sqlite3_bind_text(stmt_lookup_identifier,
+                                 5,
+                                 options.scope,
+                                 -1,
+                                 SQLITE_STATIC);
+   }
+
+   if ((result == SQLITE_OK) && (options.path != NULL))
+   {
+      result = sqlite3_bind_text(stmt_lookup_identifier,
+                                 6,
+                                 path_pattern(options.path).c_str(),
+                                 -1,
+                                 SQLITE_TRANSIENT);
+   }
+
+   if ((result == SQLITE_OK) && (options.path != NULL))
+   {
+      result = sqlite3_bind_text(stmt_lookup_identifier,
+                                 8,
+                                 path_prefix(options.path).c_str(),
+                                 -1,
+                                 SQLITE_TRANSIENT);
+   }
+
+   if ((result == SQLITE_OK) && (options.context_scope != NULL))
+   {
+      result = sqlite3_bind_text(stmt_lookup_identifier,
+                                 7,
+                                 options.context_scope,
+                                 -1,
+                                 SQLITE_STATIC);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      do
+      {
+         result = sqlite3_step(stmt_lookup_identifier);
+         if ((result == SQLITE_ROW) && (options.offset > 0))
+         {
+            options.offset--;
+         }
+         else if (result == SQLITE_ROW)
+         {
+            const char *filename = reinterpret_cast<const char*>(sqlite3_column_text(stmt_lookup_identifier, 0));
+            UINT32 line = (UINT32) sqlite3_column_int64(stmt_lookup_identifier, 1);
+            UINT32 column_start = (UINT32) sqlite3_column_int64(stmt_lookup_identifier, 2);
+            const char *scope = reinterpret_cast<const char*>(sqlite3_column_text(stmt_lookup_identifier, 3));
+            id_type type = (id_type) sqlite3_column_int64(stmt_lookup_identifier, 4);
+            const char *identifier = reinterpret_cast<const char*>(sqlite3_column_text(stmt_lookup_identifier, 5));
+            id_sub_type sub_type = (id_sub_type) sqlite3_column_int(stmt_lookup_identifier, 6);
+
+            if (matches != NULL)
+            {
+               lookup_match match;
+
+               for (int i = 0; i < LOOKUP_KEYS; i++)
+               {
+                  match.keys[i] = sqlite3_column_int64(stmt_lookup_identifier, 7 + i);
+               }
+               match.filename = filename;
+               match.line = line;
+               match.column_start = column_start;
+               match.scope = scope;
+               match.type = type;
+               match.sub_type = sub_type;
+               match.identifier = identifier;
+               matches->push_back(match);
+            }
+            else
+            {
+               lookup_output(out, filename, line, column_start, scope, type, sub_type, identifier);
+            }
+            if (options.limit > 0)
+            {
+               options.limit--;
+            }
+         }
+      } while ((result == SQLITE_ROW) && (options.limit != 0));
+
+      if ((result == SQLITE_DONE) || (result == SQLITE_ROW))
+      {
+         result = SQLITE_OK;
+      }
+   }
+
+   (void) sqlite3_reset(stmt_lookup_identifier);
+
+   return result;
+}
+
+/**
+ * Looks up an identifier pattern with the statements in the cache.
+ * With defs_first the tables are looked up one at a time in the order of
+ * lookup_rank, so the larger tables are not read once the limit is reached.
+ */
+static int index_lookup_pattern(
+   sqlite3 *index,
+   sqlite3_stmt **cache,
+   const char *identifier,
+   lookup_options& options,
+   string *out,
+   vector<lookup_match> *matches)
+{
+   sqlite3_stmt *stmt_lookup_identifier;
+   int result = SQLITE_OK;
+
+   if (!options.defs_first)
+   {
+      result = lookup_statement(index, cache, options.kinds, options, &stmt_lookup_identifier);
+      if (result == SQLITE_OK)
+      {
+         result = index_lookup_run(stmt_lookup_identifier, identifier, options, out, matches);
+      }
+      return result;
+   }
+
+   for (int i = 0; (result == SQLITE_OK) && (options.limit != 0) && (i < (int) ARRAY_SIZE(lookup_rank)); i++)
+   {
+      UINT32 kind = 1U << lookup_rank[i];
+
+      if (options.kinds & kind)
       {
-         result = sqlite3_reset(cpd.stmt_remove_file);
+         result = lookup_statement(index, cache, kind, options, &stmt_lookup_identifier);
+         if (result == SQLITE_OK)
+         {
+            result = index_lookup_run(stmt_lookup_identifier, identifier, options, out, matches);
+         }
       }
    }
 
    return result;
 }
 
-static bool file_exists(const char *filename)
+/* The lookup of a pattern in one shard, see index_lookup_shards() */
+struct lookup_shard
 {
-   struct stat buffer;
-   return stat(filename, &buffer) == 0;
+   index_db             *db;
+   const char           *identifier;
+   lookup_options       options;
+   vector<lookup_match> matches;
+   int                  result;
+};
+
+static void *lookup_shard_thread(void *arg)
+{
+   lookup_shard *ls = (lookup_shard *) arg;
+
+   ls->result = index_lookup_pattern(ls->db->index, ls->db->stmt_lookup, ls->identifier,
+                                     ls->options, NULL, &ls->matches);
+   return arg;
 }
 
-bool index_prune_files(void)
+static int match_rank(id_sub_type sub_type)
 {
-   int result;
-   bool retval = true;
-   sqlite3_stmt *stmt_iterate_files;
+   for (int i = 0; i < (int) ARRAY_SIZE(lookup_rank); i++)
+   {
+      if (lookup_rank[i] == sub_type)
+         return i;
+   }
+   return ARRAY_SIZE(lookup_rank);
+}
 
-   result = sqlite3_prepare_v2(cpd.index,
-                               "SELECT rowid,Filename FROM Files",
-                               -1,
-                               &stmt_iterate_files,
-                               NULL);
+/* The order of the matches of a lookup, as in the ORDER BY of lookup_sql() */
+static bool match_before(const lookup_match& a, const lookup_match& b, bool defs_first)
+{
+   int cmp;
 
-   if (result == SQLITE_OK)
+   if (defs_first && (match_rank(a.sub_type) != match_rank(b.sub_type)))
+      return match_rank(a.sub_type) < match_rank(b.sub_type);
+   for (int i = 0; i < LOOKUP_KEYS; i++)
    {
-      while ((result = sqlite3_step(stmt_iterate_files)) == SQLITE_ROW)
+      if (a.keys[i] != b.keys[i])
+         return a.keys[i] < b.keys[i];
+   }
+   cmp = a.filename.compare(b.filename);
+   if (cmp != 0)
+      return cmp < 0;
+   if (a.line != b.line)
+      return a.line < b.line;
+   if (a.column_start != b.column_start)
+      return a.column_start < b.column_start;
+   return a.sub_type > b.sub_type;
+}
+
+/**
+ * Looks up an identifier pattern in the shards of an index. With several
+ * shards, they are looked up in parallel, each for the first limit plus
+ * offset matches, and the matches are merged in order. The limit and
+ * offset are applied to the merged matches, and are decremented like in
+ * index_lookup_run().
+ */
+static int index_lookup_shards(
+   const vector<index_db *>& shards,
+   const char *identifier,
+   lookup_options& options,
+   string *out)
+{
+   vector<lookup_shard> lookups(shards.size());
+   vector<size_t> next(shards.size(), 0);
+   vector<void *> args;
+   int result = SQLITE_OK;
+
+   if (shards.size() == 1)
+   {
+      return index_lookup_pattern(shards[0]->index, shards[0]->stmt_lookup, identifier,
+                                  options, out, NULL);
+   }
+
+   for (size_t i = 0; i < shards.size(); i++)
+   {
+      lookups[i].db = shards[i];
+      lookups[i].identifier = identifier;
+      lookups[i].options = options;
+      lookups[i].options.offset = 0;
+      if (options.limit > 0)
       {
-         sqlite3_int64 filerow = sqlite3_column_int64(stmt_iterate_files, 0);
-         const char *filename =
-            (const char *) sqlite3_column_text(stmt_iterate_files, 1);
-         if (!file_exists(filename))
-         {
-            LOG_FMT(LNOTE, "File %s at filerow %" PRId64 " does not exist, removed from index\n", filename, (int64_t) filerow);
-            result = index_remove_file(filerow);
+         lookups[i].options.limit = options.limit + options.offset;
+      }
+      args.push_back(&lookups[i]);
+   }
+   (void) run_parallel(lookup_shard_thread, args);
 
-            if (result == SQLITE_OK)
-            {
-               result = index_prune_entries(filerow);
-            }
+   for (size_t i = 0; i < shards.size(); i++)
+   {
+      if (lookups[i].result != SQLITE_OK)
+      {
+         result = lookups[i].result;
+      }
+   }
 
-            if (result != SQLITE_OK)
-            {
-               break;
-            }
+   /* The shards are few, so the next match is found by comparing them all */
+   while ((result == SQLITE_OK) && (options.limit != 0))
+   {
+      int best = -1;
+
+      for (int i = 0; i < (int) shards.size(); i++)
+      {
+         if ((next[i] < lookups[i].matches.size()) &&
+             ((best < 0) ||
+              match_before(lookups[i].matches[next[i]], lookups[best].matches[next[best]], options.defs_first)))
+         {
+            best = i;
          }
       }
-      if (result == SQLITE_DONE)
+      if (best < 0)
       {
-         result = SQLITE_OK;
+         break;
+      }
+
+      const lookup_match& m = lookups[best].matches[next[best]++];
+
+      if (options.offset > 0)
+      {
+         options.offset--;
+         continue;
+      }
+      lookup_output(out, m.filename.c_str(), m.line, m.column_start, m.scope.c_str(),
+                    m.type, m.sub_type, m.identifier.c_str());
+      if (options.limit > 0)
+      {
+         options.limit--;
       }
    }
 
+   return result;
+}
+
+/**
+ * Looks up an identifier pattern in the tables of the kinds of the options
+ * and outputs the matches. The limit is applied in the query, so no more
+ * entries than needed are read when the matches can be found in order.
+ */
+bool index_lookup_identifier(const char *identifier, const lookup_options& options)
+{
+   lookup_options remaining = options;
+   bool retval = true;
+   int result;
+
+   if ((options.kinds == 0) || (options.limit == 0))
+   {
+      return retval;
+   }
+
+   result = index_lookup_shards(cpd.shards, identifier, remaining, NULL);
+
    if (result != SQLITE_OK)
    {
       const char *errstr = sqlite3_errstr(result);
-      LOG_FMT(LERR, "index_prune_files: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      LOG_FMT(LERR, "index_lookup_identifier: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
       retval = false;
    }
 
-   (void) sqlite3_finalize(stmt_iterate_files);
-
    return retval;
 }
 
-static int index_replace_file(const char *digest, const char *filename)
+static bool is_pattern(const string& name)
+{
+   return name.find_first_of("*?[") != string::npos;
+}
+
+/* Looks up the names in the Names table with one query and empties it */
+static int index_lookup_names(sqlite3 *index, lookup_options& options)
 {
+   sqlite3_stmt *stmt_lookup_names = NULL;
    int result;
 
-   result = sqlite3_bind_text(cpd.stmt_change_digest,
-                              1,
-                              digest,
-                              -1,
-                              SQLITE_STATIC);
+   result = sqlite3_prepare_v2(index,
+                               lookup_sql(options.kinds, true, options).c_str(),
+                               -1,
+                               &stmt_lookup_names,
+                               NULL);
 
    if (result == SQLITE_OK)
    {
-      result = sqlite3_bind_text(cpd.stmt_change_digest,
-                                 2,
-                                 filename,
-                                 -1,
-                                 SQLITE_STATIC);
+      result = index_lookup_run(stmt_lookup_names, NULL, options, NULL, NULL);
    }
 
+   (void) sqlite3_finalize(stmt_lookup_names);
+
    if (result == SQLITE_OK)
    {
-      result = sqlite3_step(cpd.stmt_change_digest);
-      if (result == SQLITE_DONE)
-      {
-         result = sqlite3_reset(cpd.stmt_change_digest);
-      }
+      result = sqlite3_exec(index, "DELETE FROM Names", NULL, NULL, NULL);
    }
 
    return result;
 }
 
-/* Returns true if the file needs to be analyzed */
-bool index_prepare_for_file(fp_data& fpd)
+/**
+ * Looks up several identifiers, and outputs the matches grouped by
+ * identifier in the order given.
+ * Consecutive names without wildcards are looked up together by joining
+ * them with the entries, patterns are looked up one at a time. In an index
+ * with several shards, all names are looked up one at a time.
+ * The limit and offset of the options apply to the matches in total.
+ */
+bool index_lookup_identifiers(const deque<string>& names, const lookup_options& options)
 {
-   int result;
+   lookup_options remaining = options;
+   sqlite3 *index = cpd.shards[0]->index;
+   sqlite3_stmt *stmt_insert_name = NULL;
    bool retval = true;
-   sqlite3_int64 filerow = 0;
+   int pending = 0;
+   int result;
 
-   result = sqlite3_bind_text(cpd.stmt_lookup_file,
-                              1,
-                              fpd.filename,
-                              -1,
-                              SQLITE_STATIC);
+   if (options.kinds == 0)
+   {
+      return retval;
+   }
+
+   result = sqlite3_exec(index,
+                         "CREATE TEMP TABLE IF NOT EXISTS Names(Seq INTEGER PRIMARY KEY, Name TEXT UNIQUE);"
+                         "DELETE FROM Names;",
+                         NULL,
+                         NULL,
+                         NULL);
 
    if (result == SQLITE_OK)
    {
-      result = sqlite3_step(cpd.stmt_lookup_file);
+      result = sqlite3_prepare_v2(index,
+                                  "INSERT OR IGNORE INTO Names(Name) VALUES(?)",
+                                  -1,
+                                  &stmt_insert_name,
+                                  NULL);
    }
 
-   if (result == SQLITE_ROW)
+   for (size_t i = 0; (result == SQLITE_OK) && (remaining.limit != 0) && (i < names.size()); i++)
    {
-      filerow = sqlite3_column_int64(cpd.stmt_lookup_file, 0);
-      const char *ingest =
-         (const char *) sqlite3_column_text(cpd.stmt_lookup_file, 1);
-
-      if (strcmp(fpd.digest, ingest) == 0)
-      {
-         LOG_FMT(LNOTE, "File %s(%s) exists in index at filerow %" PRId64 " with same digest\n", fpd.filename, fpd.digest, (int64_t) filerow);
-         result = SQLITE_OK;
-         retval = false;
-      }
-      else
+      if (!is_pattern(names[i]) && (cpd.shards.size() == 1))
       {
-         LOG_FMT(LNOTE, "File %s(%s) exists in index at filerow %" PRId64 " with different digest (%s)\n", fpd.filename, fpd.digest, (int64_t) filerow, ingest);
-         result = index_replace_file(fpd.digest, fpd.filename);
+         result = sqlite3_bind_text(stmt_insert_name, 1, names[i].c_str(), -1, SQLITE_STATIC);
          if (result == SQLITE_OK)
          {
-            result = index_prune_entries(filerow);
+            result = sqlite3_step(stmt_insert_name);
+            if (result == SQLITE_DONE)
+            {
+               result = sqlite3_reset(stmt_insert_name);
+            }
          }
+         pending++;
+         continue;
       }
-   }
-   else if (result == SQLITE_DONE)
-   {
-      result = index_insert_file(fpd.digest, fpd.filename, &filerow);
-      LOG_FMT(LNOTE, "File %s(%s) does not exist in index, inserted at filerow %" PRId64 "\n", fpd.filename, fpd.digest, (int64_t) filerow);
-   }
 
-   if (result == SQLITE_OK)
-   {
-      result = sqlite3_bind_int64(cpd.stmt_insert_reference,
-                                  1,
-                                  filerow);
+      if (pending > 0)
+      {
+         result = index_lookup_names(index, remaining);
+         pending = 0;
+      }
+      if ((result == SQLITE_OK) && (remaining.limit != 0))
+      {
+         result = index_lookup_shards(cpd.shards, names[i].c_str(), remaining, NULL);
+      }
    }
 
-   if (result == SQLITE_OK)
+   if ((result == SQLITE_OK) && (pending > 0) && (remaining.limit != 0))
    {
-      result = sqlite3_bind_int64(cpd.stmt_insert_definition,
-                                  1,
-                                  filerow);
+      result = index_lookup_names(index, remaining);
    }
 
-   if (result == SQLITE_OK)
-   {
-      result = sqlite3_bind_int64(cpd.stmt_insert_declaration,
-                                  1,
-                                  filerow);
-   }
+   (void) sqlite3_finalize(stmt_insert_name);
 
    if (result != SQLITE_OK)
    {
       const char *errstr = sqlite3_errstr(result);
-      LOG_FMT(LERR, "index_prepare_for_file: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      LOG_FMT(LERR, "index_lookup_identifiers: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
       retval = false;
    }
 
-   (void) sqlite3_reset(cpd.stmt_lookup_file);
-
    return retval;
 }
 
-void index_begin_file(fp_data& fpd)
-{
-   (void) sqlite3_reset(cpd.stmt_begin);
-   (void) sqlite3_step(cpd.stmt_begin);
-}
-
-void index_end_file(fp_data& fpd)
-{
-   (void) sqlite3_reset(cpd.stmt_commit);
-   (void) sqlite3_step(cpd.stmt_commit);
-}
-
-bool index_insert_entry(
-   fp_data& fpd,
+/**
+ * Looks up the identifier at a position in a file and outputs its
+ * definitions and declarations, or the entries of the kinds of the
+ * options, ordered by how well their scope matches the scope at the
+ * position, then by distance from the file.
+ *
+ * @param column  The column as in the lookup output, starting from 1
+ */
+bool index_lookup_position(
+   const char *filename,
    UINT32 line,
-   UINT32 column_start,
-   const char *scope,
-   id_type type,
-   id_sub_type sub_type,
-   const char *identifier)
+   UINT32 column,
+   const lookup_options& options)
 {
+   lookup_options remaining = options;
+   sqlite3_stmt *stmt_lookup_position = NULL;
+   string identifier, scope;
    bool retval = true;
    int result;
-   sqlite3_stmt *stmt_insert_entry = cpd.stmt_insert_reference;
 
-   if (sub_type == IST_DEFINITION)
-      stmt_insert_entry = cpd.stmt_insert_definition;
-   else if (sub_type == IST_DECLARATION)
-      stmt_insert_entry = cpd.stmt_insert_declaration;
+   while ((filename[0] == '.') && (filename[1] == '/'))
+   {
+      filename += 2;
+   }
 
-   result = sqlite3_bind_int64(stmt_insert_entry,
-                               2,
-                               line);
-   result |= sqlite3_bind_int64(stmt_insert_entry,
-                                3,
-                                column_start);
-   result |= sqlite3_bind_text(stmt_insert_entry,
-                               4,
-                               scope,
-                               -1,
-                               SQLITE_STATIC);
-   result |= sqlite3_bind_int(stmt_insert_entry,
-                              5,
-                              (int) type);
-   result |= sqlite3_bind_text(stmt_insert_entry,
-                               6,
-                               identifier,
+   /* The entry that starts closest before the column and covers it, in the
+    * shard of the file */
+   result = sqlite3_prepare_v2(index_shard(filename)->index,
+                               "SELECT Identifier,Scope FROM ("
+                               "SELECT ColumnStart,Scope,Identifier FROM Refs WHERE Filerow=(SELECT rowid FROM Files WHERE Filename=?1) AND Line=?2 AND ColumnStart<=?3"
+                               " UNION ALL "
+                               "SELECT ColumnStart,Scope,Identifier FROM Defs WHERE Filerow=(SELECT rowid FROM Files WHERE Filename=?1) AND Line=?2 AND ColumnStart<=?3"
+                               " UNION ALL "
+                               "SELECT ColumnStart,Scope,Identifier FROM Decls WHERE Filerow=(SELECT rowid FROM Files WHERE Filename=?1) AND Line=?2 AND ColumnStart<=?3"
+                               ") WHERE ColumnStart+length(Identifier)>?3 ORDER BY ColumnStart DESC LIMIT 1",
                                -1,
-                               SQLITE_STATIC);
+                               &stmt_lookup_position,
+                               NULL);
 
    if (result == SQLITE_OK)
    {
-      result = sqlite3_step(stmt_insert_entry);
-      if (result == SQLITE_DONE)
+      result = sqlite3_bind_text(stmt_lookup_position, 1, filename, -1, SQLITE_STATIC);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int64(stmt_lookup_position, 2, line);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_bind_int64(stmt_lookup_position, 3, column);
+   }
+
+   if (result == SQLITE_OK)
+   {
+      result = sqlite3_step(stmt_lookup_position);
+      if (result == SQLITE_ROW)
       {
-         result = sqlite3_reset(stmt_insert_entry);
+         identifier = reinterpret_cast<const char*>(sqlite3_column_text(stmt_lookup_position, 0));
+         scope = reinterpret_cast<const char*>(sqlite3_column_text(stmt_lookup_position, 1));
+         result = SQLITE_OK;
+      }
+      else if (result == SQLITE_DONE)
+      {
+         LOG_FMT(LWARN, "No identifier at %s:%u:%u\n", filename, line, column);
+         result = SQLITE_OK;
+      }
+   }
+
+   (void) sqlite3_finalize(stmt_lookup_position);
+
+   if ((result == SQLITE_OK) && !identifier.empty() && (options.kinds != 0) && (options.limit != 0))
+   {
+      remaining.context_scope = scope.c_str();
+      if (remaining.near == NULL)
+      {
+         remaining.near = filename;
       }
+      result = index_lookup_shards(cpd.shards, glob_escape(identifier.c_str()).c_str(),
+                                   remaining, NULL);
    }
 
    if (result != SQLITE_OK)
    {
       const char *errstr = sqlite3_errstr(result);
-      LOG_FMT(LERR, "index_insert_entry: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      LOG_FMT(LERR, "index_lookup_position: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
       retval = false;
    }
 
    return retval;
 }
 
-bool index_lookup_identifier(const char *identifier, id_sub_type sub_type)
+/**
+ * Opens a read-only connection to an existing index, for lookups from
+ * another thread than the one that opened the index with index_open().
+ * The lookup statements are prepared once and reused for each lookup.
+ */
+index_reader *index_reader_open(const char *index_file)
 {
-   bool retval = true;
-   sqlite3_stmt *stmt_lookup_identifier;
-   int result;
+   index_reader *rd = new index_reader;
 
-   switch (sub_type)
+   if (index_file == NULL)
    {
-      default:
-      case IST_REFERENCE:
-      {
-         result = sqlite3_prepare_v2(cpd.index,
-                                     "SELECT Files.Filename,Refs.Line,Refs.ColumnStart,Refs.Scope,Refs.Type,Refs.Identifier "
-                                     "FROM Files JOIN Refs ON Files.rowid=Refs.Filerow "
-                                     "WHERE Refs.Identifier GLOB ?",
-                                     -1,
-                                     &stmt_lookup_identifier,
-                                     NULL);
-         break;
-      }
-      case IST_DEFINITION:
-      {
-         result = sqlite3_prepare_v2(cpd.index,
-                                     "SELECT Files.Filename,Defs.Line,Defs.ColumnStart,Defs.Scope,Defs.Type,Defs.Identifier "
-                                     "FROM Files JOIN Defs ON Files.rowid=Defs.Filerow "
-                                     "WHERE Defs.Identifier GLOB ?",
-                                     -1,
-                                     &stmt_lookup_identifier,
-                                     NULL);
-         break;
-      }
-      case IST_DECLARATION:
-      {
-         result = sqlite3_prepare_v2(cpd.index,
-                                     "SELECT Files.Filename,Decls.Line,Decls.ColumnStart,Decls.Scope,Decls.Type,Decls.Identifier "
-                                     "FROM Files JOIN Decls ON Files.rowid=Decls.Filerow "
-                                     "WHERE Decls.Identifier GLOB ?",
-                                     -1,
-                                     &stmt_lookup_identifier,
-                                     NULL);
-         break;
-      }
+      index_file = "TOKS";
    }
 
-   if (result == SQLITE_OK)
+   if (!index_open_shards(index_file, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, false, rd->shards))
    {
-      result = sqlite3_bind_text(stmt_lookup_identifier,
-                                 1,
-                                 identifier != NULL ? identifier : "%",
-                                 -1,
-                                 SQLITE_STATIC);
+      delete rd;
+      rd = NULL;
    }
 
-   if (result == SQLITE_OK)
+   return rd;
+}
+
+void index_reader_close(index_reader *rd)
+{
+   for (size_t i = 0; i < rd->shards.size(); i++)
    {
-      do
-      {
-         result = sqlite3_step(stmt_lookup_identifier);
-         if (result == SQLITE_ROW)
-         {
-            const char *filename = reinterpret_cast<const char*>(sqlite3_column_text(stmt_lookup_identifier, 0));
-            UINT32 line = (UINT32) sqlite3_column_int64(stmt_lookup_identifier, 1);
-            UINT32 column_start = (UINT32) sqlite3_column_int64(stmt_lookup_identifier, 2);
-            const char *scope = reinterpret_cast<const char*>(sqlite3_column_text(stmt_lookup_identifier, 3));
-            id_type type = (id_type) sqlite3_column_int64(stmt_lookup_identifier, 4);
-            const char *identifier = reinterpret_cast<const char*>(sqlite3_column_text(stmt_lookup_identifier, 5));
-            output_identifier(
-               filename,
-               line,
-               column_start,
-               scope,
-               type,
-               sub_type,
-               identifier);
-         }
-      } while (result == SQLITE_ROW);
+      index_db_close(rd->shards[i]);
+   }
+   delete rd;
+}
 
-      if (result == SQLITE_DONE)
-      {
-         result = SQLITE_OK;
-      }
+/**
+ * Same as index_lookup_identifier(), but appends the matches to out.
+ */
+bool index_reader_lookup(
+   index_reader *rd,
+   const char *identifier,
+   const lookup_options& options,
+   string& out)
+{
+   lookup_options remaining = options;
+   int result;
+
+   if ((options.kinds == 0) || (options.limit == 0))
+   {
+      return true;
    }
 
+   result = index_lookup_shards(rd->shards, identifier, remaining, &out);
+
    if (result != SQLITE_OK)
    {
       const char *errstr = sqlite3_errstr(result);
-      LOG_FMT(LERR, "index_lookup_identifier: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
-      retval = false;
+      LOG_FMT(LERR, "index_reader_lookup: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      return false;
    }
 
-   (void) sqlite3_finalize(stmt_lookup_identifier);
-
-   return retval;
+   return true;
 }
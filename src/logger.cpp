@@ -5,6 +5,7 @@
  *
  * If a log statement ends in a newline, the current log is ended.
  * When the log severity changes, an implicit newline is inserted.
+ * The log buffer is shared by all threads, so it is used under a lock.
  *
  * @author  Ben Gardner
  * @license GPL v2+
@@ -15,6 +16,9 @@
 #include <stdarg.h>
 #include <cctype>
 #include "log_levels.h"
+#ifndef WIN32
+#include <pthread.h>
+#endif
 
 
 /** Private log structure */
@@ -34,6 +38,28 @@ struct log_buf
 };
 static struct log_buf g_log;
 
+#ifndef WIN32
+static pthread_mutex_t g_log_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/** Holds the log lock for the lifetime of the object */
+struct log_locker
+{
+   log_locker()
+   {
+#ifndef WIN32
+      pthread_mutex_lock(&g_log_lock);
+#endif
+   }
+
+   ~log_locker()
+   {
+#ifndef WIN32
+      pthread_mutex_unlock(&g_log_lock);
+#endif
+   }
+};
+
 
 /**
  * Initializes the log subsystem - call this first.
@@ -190,6 +216,7 @@ void log_str(log_sev_t sev, const char *str, int len)
       return;
    }
 
+   log_locker lock;
    size_t cap = log_start(sev);
    if (cap > 0)
    {
@@ -223,6 +250,8 @@ void log_fmt(log_sev_t sev, const char *fmt, ...)
       return;
    }
 
+   log_locker lock;
+
    /* Some implementation of vsnprintf() return the number of characters
     * that would have been stored if the buffer was large enough instead of
     * the number of characters actually stored.
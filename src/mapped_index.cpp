@@ -0,0 +1,763 @@
+/**
+ * @file mapped_index.cpp
+ * A read-only binary copy of the index that is looked up directly in a
+ * memory mapping, for lookup servers that don't need to update the index.
+ *
+ * The file is written by mapped_index_export() and has these sections:
+ *
+ *    header         see mapped_header
+ *    file table     UINT32 offsets[files + 1] of the NUL terminated names
+ *                   that follow, the files are sorted by name
+ *    scope table    same, for the scopes
+ *    block table    UINT64 offsets[blocks] of the first posting list of
+ *                   each dictionary block, then UINT32 offsets[blocks + 1]
+ *                   of the dictionary blocks
+ *    dictionary     the identifiers in memcmp() order, in blocks of
+ *                   MAPPED_BLOCK_SIZE. Each identifier is stored as the
+ *                   length of the prefix shared with the previous one
+ *                   (0 for the first in a block), the length and bytes of
+ *                   the rest, the number of entries and the size of its
+ *                   posting list.
+ *    postings       for each identifier, its entries ordered like a lookup
+ *                   (file, line, column, kind). Each entry is the file
+ *                   number relative to the previous entry, the line (relative
+ *                   in the same file), the column, (type << 2 | kind) and
+ *                   the scope number.
+ *
+ * All numbers in the dictionary and postings are varints, 7 bits per byte
+ * with the high bit set on all but the last byte. The other numbers are in
+ * the byte order of the machine that wrote the file.
+ *
+ * A lookup finds the first block that can hold the pattern by binary
+ * search of the first identifier of each block, and decodes the blocks
+ * from there for as long as the identifiers can match the pattern. The
+ * posting lists of all matching identifiers are merged to get the same
+ * order as a lookup in the SQLite index.
+ *
+ * @author  Thomas Thorsen
+ * @license GPL v2+
+ */
+#include "toks_types.h"
+#include "prototypes.h"
+#include "sqlite3080200.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#define MAPPED_MAGIC       "TOKSMAP"
+#define MAPPED_VERSION     1
+#define MAPPED_BLOCK_SIZE  16
+
+struct mapped_header
+{
+   char   magic[8];
+   UINT32 version;
+   UINT32 files;
+   UINT32 scopes;
+   UINT32 identifiers;
+   UINT32 blocks;
+   UINT32 reserved;
+   UINT64 file_table;
+   UINT64 scope_table;
+   UINT64 block_table;
+   UINT64 dictionary;
+   UINT64 postings;
+   UINT64 size;
+};
+
+/* A decoded posting list entry */
+struct mapped_entry
+{
+   UINT32 file;
+   UINT32 line;
+   UINT32 column;
+   UINT32 type;
+   UINT32 scope;
+};
+
+/* The posting list of a matching identifier during a lookup */
+struct mapped_cursor
+{
+   string              identifier;
+   const UINT8         *pos;
+   UINT32              left;
+   mapped_entry        entry;
+};
+
+struct mapped_index
+{
+   const UINT8                 *data;
+   size_t                      size;
+   bool                        mapped;
+   const mapped_header         *header;
+   const UINT32                *file_offsets;
+   const char                  *file_names;
+   const UINT32                *scope_offsets;
+   const char                  *scope_names;
+   const UINT32                *block_offsets;
+   const UINT64                *block_postings;
+   const UINT8                 *dictionary;
+   const UINT8                 *postings;
+   vector<mapped_cursor>       cursors;   /* reused between lookups */
+   vector<int>                 heap;
+};
+
+
+static void put_varint(vector<UINT8>& out, UINT64 value)
+{
+   while (value >= 0x80)
+   {
+      out.push_back((UINT8) (value | 0x80));
+      value >>= 7;
+   }
+   out.push_back((UINT8) value);
+}
+
+static inline UINT64 get_varint(const UINT8 *& pos)
+{
+   UINT64 value = 0;
+   int shift = 0;
+
+   while (*pos & 0x80)
+   {
+      value |= (UINT64) (*pos++ & 0x7f) << shift;
+      shift += 7;
+   }
+   value |= (UINT64) *pos++ << shift;
+
+   return value;
+}
+
+static void align(vector<UINT8>& out, size_t alignment)
+{
+   while (out.size() % alignment != 0)
+   {
+      out.push_back(0);
+   }
+}
+
+/* Appends a table of UINT32 offsets followed by the NUL terminated strings */
+static void put_string_table(vector<UINT8>& out, const vector<string>& strings)
+{
+   size_t table = out.size();
+   UINT32 offset = 0;
+
+   out.resize(table + (strings.size() + 1) * sizeof(UINT32));
+   for (size_t i = 0; i <= strings.size(); i++)
+   {
+      memcpy(&out[table + i * sizeof(UINT32)], &offset, sizeof(UINT32));
+      if (i < strings.size())
+      {
+         out.insert(out.end(), strings[i].begin(), strings[i].end());
+         out.push_back(0);
+         offset += strings[i].size() + 1;
+      }
+   }
+   align(out, 8);
+}
+
+
+static bool entry_before(const mapped_entry& a, const mapped_entry& b)
+{
+   if (a.file != b.file)
+      return a.file < b.file;
+   if (a.line != b.line)
+      return a.line < b.line;
+   if (a.column != b.column)
+      return a.column < b.column;
+   /* Same order of the kinds as a lookup in the SQLite index */
+   return (a.type & 3) > (b.type & 3);
+}
+
+struct mapped_writer
+{
+   vector<UINT8>  dictionary;
+   vector<UINT8>  postings;
+   vector<UINT32> block_offsets;
+   vector<UINT64> block_postings;
+   string         previous;
+   UINT32         identifiers;
+};
+
+/* Adds an identifier and its entries to the dictionary and postings */
+static void add_identifier(mapped_writer& w, const string& identifier, vector<mapped_entry>& entries)
+{
+   size_t start = w.postings.size();
+   size_t shared = 0;
+   UINT32 file = 0, line = 0;
+
+   if (w.identifiers % MAPPED_BLOCK_SIZE == 0)
+   {
+      w.block_offsets.push_back(w.dictionary.size());
+      w.block_postings.push_back(start);
+   }
+   else
+   {
+      while ((shared < identifier.size()) && (shared < w.previous.size()) &&
+             (identifier[shared] == w.previous[shared]))
+      {
+         shared++;
+      }
+   }
+
+   sort(entries.begin(), entries.end(), entry_before);
+   for (size_t i = 0; i < entries.size(); i++)
+   {
+      const mapped_entry& e = entries[i];
+
+      put_varint(w.postings, e.file - file);
+      put_varint(w.postings, (e.file == file) ? e.line - line : e.line);
+      put_varint(w.postings, e.column);
+      put_varint(w.postings, e.type);
+      put_varint(w.postings, e.scope);
+      file = e.file;
+      line = e.line;
+   }
+
+   put_varint(w.dictionary, shared);
+   put_varint(w.dictionary, identifier.size() - shared);
+   w.dictionary.insert(w.dictionary.end(), identifier.begin() + shared, identifier.end());
+   put_varint(w.dictionary, entries.size());
+   put_varint(w.dictionary, w.postings.size() - start);
+
+   w.previous = identifier;
+   w.identifiers++;
+}
+
+static bool write_file(const char *filename, const vector<UINT8>& data)
+{
+   string tmp = string(filename) + ".tmp";
+   FILE *p_file = fopen(tmp.c_str(), "wb");
+   bool ok;
+
+   if (p_file == NULL)
+   {
+      LOG_FMT(LERR, "%s: fopen(%s) failed: %s (%d)\n",
+              __func__, tmp.c_str(), strerror(errno), errno);
+      return false;
+   }
+
+   ok = (fwrite(&data[0], 1, data.size(), p_file) == data.size());
+   ok = (fclose(p_file) == 0) && ok;
+
+   /* Replaced in one step, so a server never maps a partial file */
+   if (!ok || (rename(tmp.c_str(), filename) != 0))
+   {
+      LOG_FMT(LERR, "%s: writing %s failed: %s (%d)\n",
+              __func__, filename, strerror(errno), errno);
+      (void) unlink(tmp.c_str());
+      return false;
+   }
+   return true;
+}
+
+
+/**
+ * Writes the entries of the open index to a mapped index file. The entries
+ * of the shards are merged by identifier.
+ */
+bool mapped_index_export(const char *filename)
+{
+   size_t shards = cpd.shards.size();
+   vector<pair<string, pair<size_t, sqlite3_int64> > > file_rows;
+   map<pair<size_t, sqlite3_int64>, UINT32> file_numbers;
+   map<string, UINT32> scope_numbers;
+   vector<string> files, scopes;
+   vector<mapped_entry> entries;
+   vector<sqlite3_stmt *> stmts(shards, (sqlite3_stmt *) NULL);
+   vector<char> more(shards, 0);
+   mapped_writer w;
+   mapped_header header;
+   vector<UINT8> out;
+   string identifier;
+   int result = SQLITE_OK;
+
+   w.identifiers = 0;
+
+   for (size_t s = 0; (result == SQLITE_OK) && (s < shards); s++)
+   {
+      sqlite3_stmt *stmt = NULL;
+
+      result = sqlite3_prepare_v2(cpd.shards[s]->index,
+                                  "SELECT rowid,Filename FROM Files",
+                                  -1,
+                                  &stmt,
+                                  NULL);
+      while ((result == SQLITE_OK) && ((result = sqlite3_step(stmt)) == SQLITE_ROW))
+      {
+         file_rows.push_back(make_pair(string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1))),
+                                       make_pair(s, sqlite3_column_int64(stmt, 0))));
+         result = SQLITE_OK;
+      }
+      (void) sqlite3_finalize(stmt);
+      if (result == SQLITE_DONE)
+      {
+         result = SQLITE_OK;
+      }
+   }
+
+   /* Numbered in name order, so the entries can be ordered by number */
+   sort(file_rows.begin(), file_rows.end());
+   for (size_t i = 0; i < file_rows.size(); i++)
+   {
+      file_numbers[file_rows[i].second] = files.size();
+      files.push_back(file_rows[i].first);
+   }
+
+   for (size_t s = 0; (result == SQLITE_OK) && (s < shards); s++)
+   {
+      char sql[512];
+
+      /* Entries with a negative Filerow are in the parse cache */
+      snprintf(sql, sizeof(sql),
+               "SELECT Identifier,Filerow,Line,ColumnStart,Type,SubType,Scope FROM ("
+               "SELECT *,%d AS SubType FROM Refs WHERE Filerow>0 UNION ALL "
+               "SELECT *,%d AS SubType FROM Defs WHERE Filerow>0 UNION ALL "
+               "SELECT *,%d AS SubType FROM Decls WHERE Filerow>0) ORDER BY Identifier",
+               IST_REFERENCE, IST_DEFINITION, IST_DECLARATION);
+      result = sqlite3_prepare_v2(cpd.shards[s]->index, sql, -1, &stmts[s], NULL);
+      if (result == SQLITE_OK)
+      {
+         result = sqlite3_step(stmts[s]);
+         more[s] = (result == SQLITE_ROW);
+         if ((result == SQLITE_ROW) || (result == SQLITE_DONE))
+         {
+            result = SQLITE_OK;
+         }
+      }
+   }
+
+   /* Each identifier, with the entries of all shards that have it */
+   while (result == SQLITE_OK)
+   {
+      const char *next = NULL;
+
+      for (size_t s = 0; s < shards; s++)
+      {
+         const char *id = more[s] ? reinterpret_cast<const char*>(sqlite3_column_text(stmts[s], 0)) : NULL;
+
+         if ((id != NULL) && ((next == NULL) || (strcmp(id, next) < 0)))
+         {
+            next = id;
+         }
+      }
+      if (next == NULL)
+      {
+         break;
+      }
+      identifier = next;
+      entries.clear();
+
+      for (size_t s = 0; (result == SQLITE_OK) && (s < shards); s++)
+      {
+         while (more[s] && (identifier == reinterpret_cast<const char*>(sqlite3_column_text(stmts[s], 0))))
+         {
+            const char *scope = reinterpret_cast<const char*>(sqlite3_column_text(stmts[s], 6));
+            map<string, UINT32>::iterator it = scope_numbers.find(scope);
+            mapped_entry e;
+
+            if (it == scope_numbers.end())
+            {
+               it = scope_numbers.insert(make_pair(string(scope), (UINT32) scopes.size())).first;
+               scopes.push_back(scope);
+            }
+
+            e.file = file_numbers[make_pair(s, sqlite3_column_int64(stmts[s], 1))];
+            e.line = (UINT32) sqlite3_column_int64(stmts[s], 2);
+            e.column = (UINT32) sqlite3_column_int64(stmts[s], 3);
+            e.type = ((UINT32) sqlite3_column_int(stmts[s], 4) << 2) | (UINT32) sqlite3_column_int(stmts[s], 5);
+            e.scope = it->second;
+            entries.push_back(e);
+
+            result = sqlite3_step(stmts[s]);
+            more[s] = (result == SQLITE_ROW);
+            if ((result != SQLITE_ROW) && (result != SQLITE_DONE))
+            {
+               break;
+            }
+            result = SQLITE_OK;
+         }
+      }
+
+      if (result == SQLITE_OK)
+      {
+         add_identifier(w, identifier, entries);
+      }
+   }
+
+   for (size_t s = 0; s < shards; s++)
+   {
+      (void) sqlite3_finalize(stmts[s]);
+   }
+
+   if (result != SQLITE_OK)
+   {
+      const char *errstr = sqlite3_errstr(result);
+      LOG_FMT(LERR, "mapped_index_export: access error (%d: %s)\n", result, errstr != NULL ? errstr : "");
+      return false;
+   }
+   w.block_offsets.push_back(w.dictionary.size());
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC));
+   header.version = MAPPED_VERSION;
+   header.files = files.size();
+   header.scopes = scopes.size();
+   header.identifiers = w.identifiers;
+   header.blocks = w.block_postings.size();
+
+   out.resize(sizeof(header));
+   header.file_table = out.size();
+   put_string_table(out, files);
+   header.scope_table = out.size();
+   put_string_table(out, scopes);
+   header.block_table = out.size();
+   if (!w.block_postings.empty())
+   {
+      out.insert(out.end(), (const UINT8 *) &w.block_postings[0],
+                 (const UINT8 *) (&w.block_postings[0] + w.block_postings.size()));
+   }
+   out.insert(out.end(), (const UINT8 *) &w.block_offsets[0],
+              (const UINT8 *) (&w.block_offsets[0] + w.block_offsets.size()));
+   header.dictionary = out.size();
+   out.insert(out.end(), w.dictionary.begin(), w.dictionary.end());
+   header.postings = out.size();
+   out.insert(out.end(), w.postings.begin(), w.postings.end());
+   header.size = out.size();
+   memcpy(&out[0], &header, sizeof(header));
+
+   LOG_FMT(LNOTE, "%s: %u identifiers, %u files, %u scopes, %" PRIu64 " bytes\n",
+           filename, header.identifiers, header.files, header.scopes, header.size);
+
+   return write_file(filename, out);
+}
+
+
+/**
+ * Opens a mapped index file written by mapped_index_export().
+ * Returns NULL if the file can't be read or is not a mapped index.
+ */
+mapped_index *mapped_index_open(const char *filename)
+{
+   mapped_index *mi;
+   const mapped_header *h;
+   struct stat st;
+   int fd;
+
+   fd = open(filename, O_RDONLY);
+   if ((fd < 0) || (fstat(fd, &st) != 0))
+   {
+      LOG_FMT(LERR, "%s: open(%s) failed: %s (%d)\n",
+              __func__, filename, strerror(errno), errno);
+      if (fd >= 0)
+         close(fd);
+      return NULL;
+   }
+
+   mi = new mapped_index;
+   mi->size = st.st_size;
+   mi->data = NULL;
+   mi->mapped = false;
+
+#ifndef WIN32
+   void *p = mmap(NULL, mi->size, PROT_READ, MAP_SHARED, fd, 0);
+   if (p != MAP_FAILED)
+   {
+      mi->data = (const UINT8 *) p;
+      mi->mapped = true;
+   }
+#endif
+   if (mi->data == NULL)
+   {
+      UINT8 *buf = new UINT8[mi->size + 1];
+      size_t got = 0;
+      ssize_t n;
+
+      while ((got < mi->size) && ((n = read(fd, buf + got, mi->size - got)) > 0))
+      {
+         got += n;
+      }
+      mi->data = buf;
+      mi->size = got;
+   }
+   close(fd);
+
+   h = (const mapped_header *) mi->data;
+   if ((mi->size < sizeof(*h)) ||
+       (memcmp(h->magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC)) != 0) ||
+       (h->version != MAPPED_VERSION) ||
+       (h->size != mi->size) ||
+       (h->file_table > h->scope_table) || (h->scope_table > h->block_table) ||
+       (h->block_table > h->dictionary) || (h->dictionary > h->postings) ||
+       (h->postings > h->size))
+   {
+      LOG_FMT(LERR, "%s: %s is not a mapped index of this version\n", __func__, filename);
+      mapped_index_close(mi);
+      return NULL;
+   }
+
+   mi->header = h;
+   mi->file_offsets = (const UINT32 *) (mi->data + h->file_table);
+   mi->file_names = (const char *) (mi->file_offsets + h->files + 1);
+   mi->scope_offsets = (const UINT32 *) (mi->data + h->scope_table);
+   mi->scope_names = (const char *) (mi->scope_offsets + h->scopes + 1);
+   mi->block_postings = (const UINT64 *) (mi->data + h->block_table);
+   mi->block_offsets = (const UINT32 *) (mi->block_postings + h->blocks);
+   mi->dictionary = mi->data + h->dictionary;
+   mi->postings = mi->data + h->postings;
+
+   return mi;
+}
+
+void mapped_index_close(mapped_index *mi)
+{
+#ifndef WIN32
+   if (mi->mapped)
+   {
+      (void) munmap((void *) mi->data, mi->size);
+   }
+   else
+#endif
+   {
+      delete[] mi->data;
+   }
+   delete mi;
+}
+
+/* Compares the first identifier of a block with a string */
+static int compare_block(const mapped_index *mi, UINT32 block, const char *str, size_t len)
+{
+   const UINT8 *pos = mi->dictionary + mi->block_offsets[block];
+   size_t key_len;
+   int cmp;
+
+   (void) get_varint(pos);   /* nothing shared */
+   key_len = get_varint(pos);
+
+   cmp = memcmp(pos, str, min(key_len, len));
+   if (cmp == 0)
+   {
+      cmp = (key_len < len) ? -1 : (key_len > len) ? 1 : 0;
+   }
+   return cmp;
+}
+
+/* Reads the next entry of a cursor, returns false at the end of its list */
+static inline bool cursor_next(mapped_cursor& c)
+{
+   UINT32 file_delta;
+
+   if (c.left == 0)
+   {
+      return false;
+   }
+   c.left--;
+
+   file_delta = get_varint(c.pos);
+   c.entry.file += file_delta;
+   c.entry.line = (file_delta == 0) ? c.entry.line + get_varint(c.pos) : get_varint(c.pos);
+   c.entry.column = get_varint(c.pos);
+   c.entry.type = get_varint(c.pos);
+   c.entry.scope = get_varint(c.pos);
+
+   return true;
+}
+
+/* Adds the posting list of a matching identifier to the lookup */
+static void add_cursor(mapped_index *mi, size_t& count, const string& identifier,
+                       const UINT8 *postings, UINT32 entries)
+{
+   if (count == mi->cursors.size())
+   {
+      mi->cursors.resize(count + 1);
+   }
+
+   mapped_cursor& c = mi->cursors[count];
+   c.identifier = identifier;
+   c.pos = postings;
+   c.left = entries;
+   c.entry.file = 0;
+   c.entry.line = 0;
+   if (cursor_next(c))
+   {
+      count++;
+   }
+}
+
+/* Orders the heap of cursors so the one with the first entry is on top */
+struct cursor_after
+{
+   const vector<mapped_cursor>& cursors;
+
+   cursor_after(const vector<mapped_cursor>& c) : cursors(c) { }
+
+   bool operator()(int a, int b) const
+   {
+      return entry_before(cursors[b].entry, cursors[a].entry);
+   }
+};
+
+/* Outputs an entry if it passes the filters, returns false when the limit is reached */
+static bool output_entry(const mapped_index *mi, const mapped_cursor& c, lookup_options& options)
+{
+   const mapped_entry& e = c.entry;
+
+   if (((options.kinds & (1U << (e.type & 3))) == 0) ||
+       ((options.types != 0) && ((options.types & (1U << (e.type >> 2))) == 0)))
+   {
+      return true;
+   }
+   if (options.offset > 0)
+   {
+      options.offset--;
+      return true;
+   }
+
+   output_identifier(mi->file_names + mi->file_offsets[e.file],
+                     e.line,
+                     e.column,
+                     mi->scope_names + mi->scope_offsets[e.scope],
+                     (id_type) (e.type >> 2),
+                     (id_sub_type) (e.type & 3),
+                     c.identifier.c_str());
+
+   if (options.limit > 0)
+   {
+      options.limit--;
+   }
+   return options.limit != 0;
+}
+
+
+/**
+ * Looks up an identifier pattern in a mapped index and outputs the
+ * matches in the same order as index_lookup_identifier().
+ * The kinds, types, limit and offset of the options are supported, the
+ * limit and offset are decremented like in index_lookup_run().
+ */
+bool mapped_index_lookup(mapped_index *mi, const char *pattern, lookup_options& options)
+{
+   size_t prefix_len = strcspn(pattern, "*?[");
+   bool exact = (pattern[prefix_len] == 0);
+   string key;
+   size_t count = 0;
+   UINT32 lo = 0, hi = mi->header->blocks;
+
+   if ((options.kinds == 0) || (options.limit == 0))
+   {
+      return true;
+   }
+
+   /* The last block that starts before the prefix */
+   while (lo < hi)
+   {
+      UINT32 mid = lo + (hi - lo) / 2;
+
+      if (compare_block(mi, mid, pattern, prefix_len) < 0)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   for (UINT32 block = (lo > 0) ? lo - 1 : 0; block < mi->header->blocks; block++)
+   {
+      const UINT8 *pos = mi->dictionary + mi->block_offsets[block];
+      const UINT8 *end = mi->dictionary + mi->block_offsets[block + 1];
+      const UINT8 *postings = mi->postings + mi->block_postings[block];
+      bool past = false;
+
+      while ((pos < end) && !past)
+      {
+         size_t shared = get_varint(pos);
+         size_t len = get_varint(pos);
+         UINT32 entries, size;
+         int cmp;
+
+         key.resize(shared);
+         key.append((const char *) pos, len);
+         pos += len;
+         entries = get_varint(pos);
+         size = get_varint(pos);
+
+         cmp = memcmp(key.data(), pattern, min(key.size(), prefix_len));
+         if ((cmp == 0) && (key.size() < prefix_len))
+         {
+            cmp = -1;
+         }
+
+         if (cmp > 0)
+         {
+            /* Past the identifiers that start with the prefix */
+            past = true;
+         }
+         else if (cmp == 0)
+         {
+            if (exact ? (key.size() == prefix_len) : (sqlite3_strglob(pattern, key.c_str()) == 0))
+            {
+               add_cursor(mi, count, key, postings, entries);
+            }
+            /* The next identifiers are longer than an exact pattern */
+            past = exact;
+         }
+         postings += size;
+      }
+      if (past)
+      {
+         break;
+      }
+   }
+
+   if (count == 1)
+   {
+      mapped_cursor& c = mi->cursors[0];
+
+      while (output_entry(mi, c, options) && cursor_next(c))
+      {
+      }
+   }
+   else if (count > 1)
+   {
+      cursor_after after(mi->cursors);
+
+      mi->heap.resize(count);
+      for (size_t i = 0; i < count; i++)
+      {
+         mi->heap[i] = i;
+      }
+      make_heap(mi->heap.begin(), mi->heap.end(), after);
+
+      while (!mi->heap.empty())
+      {
+         mapped_cursor& c = mi->cursors[mi->heap.front()];
+
+         if (!output_entry(mi, c, options))
+         {
+            break;
+         }
+         pop_heap(mi->heap.begin(), mi->heap.end(), after);
+         if (cursor_next(c))
+         {
+            push_heap(mi->heap.begin(), mi->heap.end(), after);
+         }
+         else
+         {
+            mi->heap.pop_back();
+         }
+      }
+   }
+
+   return true;
+}
@@ -11,6 +11,8 @@
 #include "chunk_list.h"
 #include <cctype>
 #include <cstdlib>
+#include <cstring>
+#include <strings.h>  /* strcasecmp() */
 
 
 const char *type_strings[] =
@@ -41,6 +43,96 @@ const char *sub_type_strings[] =
 };
 
 
+#define IT_ALL_BITS ((1U << ARRAY_SIZE(type_strings)) - 1)
+
+
+/**
+ * Parses a comma separated list of identifier type names into a bit mask
+ * of (1 << id_type). "ALL" and "NONE" select everything or nothing, and a
+ * name prefixed with '-' removes that type. If the first name is removed
+ * the list starts out from all types, so "-IDENTIFIER,-VAR" means all but
+ * identifiers and variables.
+ *
+ * @param str     The list
+ * @param types   Set to the resulting bit mask
+ * @return        false if the list contains an unknown type name
+ */
+bool id_types_from_string(const char *str, UINT32& types)
+{
+   string list(str);
+   size_t start = 0;
+   bool first = true;
+
+   types = 0;
+
+   while (start <= list.size())
+   {
+      size_t end = list.find(',', start);
+      if (end == string::npos)
+      {
+         end = list.size();
+      }
+
+      string name = list.substr(start, end - start);
+      bool remove = (name.size() > 0) && (name[0] == '-');
+      if (remove)
+      {
+         name.erase(0, 1);
+         if (first)
+         {
+            types = IT_ALL_BITS;
+         }
+      }
+      first = false;
+
+      UINT32 bits = 0;
+      if (strcasecmp(name.c_str(), "ALL") == 0)
+      {
+         bits = IT_ALL_BITS;
+      }
+      else if (strcasecmp(name.c_str(), "NONE") != 0)
+      {
+         size_t i;
+
+         for (i = 0; i < ARRAY_SIZE(type_strings); i++)
+         {
+            if (strcasecmp(name.c_str(), type_strings[i]) == 0)
+            {
+               bits = 1U << i;
+               break;
+            }
+         }
+         if (i == ARRAY_SIZE(type_strings))
+         {
+            LOG_FMT(LERR, "Unknown identifier type: %s\n", name.c_str());
+            return false;
+         }
+      }
+
+      if (remove)
+         types &= ~bits;
+      else
+         types |= bits;
+
+      start = end + 1;
+   }
+
+   return true;
+}
+
+UINT32 id_types_all(void)
+{
+   return IT_ALL_BITS;
+}
+
+
+/* References inside parameter lists and function bodies have a function scope */
+static bool in_function_scope(chunk_t *pc)
+{
+   return (pc->scope.find("{}") != string::npos) ||
+          (pc->scope.find("()") != string::npos);
+}
+
 static id_sub_type sub_type_from_flags(chunk_t *pc)
 {
    if (pc->flags & PCF_DEF)
@@ -53,6 +145,149 @@ static id_sub_type sub_type_from_flags(chunk_t *pc)
       return IST_REFERENCE;
 }
 
+/* Lookup results are collected here and written to stdout in large blocks */
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+static string output_buffer;
+
+static void append_uint(string& out, UINT32 value)
+{
+   char digits[10];
+   int  len = 0;
+
+   do
+   {
+      digits[len++] = (char) ('0' + (value % 10));
+      value /= 10;
+   } while (value != 0);
+
+   while (len > 0)
+   {
+      out += digits[--len];
+   }
+}
+
+static void append_json_string(string& out, const char *str)
+{
+   static const char hex[] = "0123456789abcdef";
+
+   out += '"';
+   for (; *str != 0; str++)
+   {
+      unsigned char ch = (unsigned char) *str;
+
+      if ((ch == '"') || (ch == '\\'))
+      {
+         out += '\\';
+         out += (char) ch;
+      }
+      else if (ch < 0x20)
+      {
+         out += "\\u00";
+         out += hex[ch >> 4];
+         out += hex[ch & 0xf];
+      }
+      else
+      {
+         out += (char) ch;
+      }
+   }
+   out += '"';
+}
+
+/**
+ * Parses the name of an output format.
+ *
+ * @return false if the name is unknown
+ */
+bool output_format_from_string(const char *str, output_format& format)
+{
+   if (strcmp(str, "text") == 0)
+      format = OF_TEXT;
+   else if (strcmp(str, "json") == 0)
+      format = OF_JSON;
+   else if (strcmp(str, "nul") == 0)
+      format = OF_NUL;
+   else
+      return false;
+   return true;
+}
+
+/**
+ * Appends a lookup result to a string in the given format:
+ *  OF_TEXT: "file:line:column scope TYPE SUBTYPE identifier" and a newline
+ *  OF_JSON: a JSON object and a newline (JSON lines)
+ *  OF_NUL:  the seven fields of OF_TEXT, each terminated by a NUL character
+ */
+void format_identifier(
+   string& out,
+   output_format format,
+   const char *filename,
+   UINT32 line,
+   UINT32 column_start,
+   const char *scope,
+   id_type type,
+   id_sub_type sub_type,
+   const char *identifier)
+{
+   switch (format)
+   {
+      default:
+      case OF_TEXT:
+         out += filename;
+         out += ':';
+         append_uint(out, line);
+         out += ':';
+         append_uint(out, column_start);
+         out += ' ';
+         out += scope;
+         out += ' ';
+         out += type_strings[type];
+         out += ' ';
+         out += sub_type_strings[sub_type];
+         out += ' ';
+         out += identifier;
+         out += '\n';
+         break;
+
+      case OF_JSON:
+         out += "{\"file\":";
+         append_json_string(out, filename);
+         out += ",\"line\":";
+         append_uint(out, line);
+         out += ",\"column\":";
+         append_uint(out, column_start);
+         out += ",\"scope\":";
+         append_json_string(out, scope);
+         out += ",\"type\":\"";
+         out += type_strings[type];
+         out += "\",\"kind\":\"";
+         out += sub_type_strings[sub_type];
+         out += "\",\"identifier\":";
+         append_json_string(out, identifier);
+         out += "}\n";
+         break;
+
+      case OF_NUL:
+         out += filename;
+         out += '\0';
+         append_uint(out, line);
+         out += '\0';
+         append_uint(out, column_start);
+         out += '\0';
+         out += scope;
+         out += '\0';
+         out += type_strings[type];
+         out += '\0';
+         out += sub_type_strings[sub_type];
+         out += '\0';
+         out += identifier;
+         out += '\0';
+         break;
+   }
+}
+
+/* Outputs a lookup result to stdout in the format given by cpd.format */
 void output_identifier(
    const char *filename,
    UINT32 line,
@@ -62,9 +297,31 @@ void output_identifier(
    id_sub_type sub_type,
    const char *identifier)
 {
-   printf("%s:%u:%d %s %s %s %s\n", filename, line, column_start, scope, type_strings[type], sub_type_strings[sub_type], identifier);
+   if (output_buffer.capacity() < OUTPUT_BUFFER_SIZE)
+   {
+      output_buffer.reserve(OUTPUT_BUFFER_SIZE);
+   }
+
+   format_identifier(output_buffer, cpd.format, filename, line, column_start,
+                     scope, type, sub_type, identifier);
+
+   if (output_buffer.size() >= OUTPUT_BUFFER_SIZE - 1024)
+   {
+      output_flush();
+   }
 }
 
+void output_flush(void)
+{
+   if (!output_buffer.empty())
+   {
+      fwrite(output_buffer.data(), 1, output_buffer.size(), stdout);
+      output_buffer.clear();
+   }
+   fflush(stdout);
+}
+
+
 void output(fp_data& fpd)
 {
    chunk_t *pc;
@@ -191,6 +448,21 @@ void output(fp_data& fpd)
             continue;
       }
 
+      /* The classification is incomplete if parsing was abandoned */
+      if (fpd.mode == PM_IDENTIFIERS)
+      {
+         type = IT_IDENTIFIER;
+         sub_type = IST_REFERENCE;
+      }
+
+      if (sub_type == IST_REFERENCE)
+      {
+         UINT32 types = in_function_scope(pc) ? cpd.func_ref_types : cpd.ref_types;
+
+         if ((fpd.mode == PM_DECLS_ONLY) || ((types & (1U << type)) == 0))
+            continue;
+      }
+
       (void) index_insert_entry(fpd,
                                 pc->orig_line,
                                 pc->orig_col,
@@ -23,6 +23,10 @@ c_token_t find_token_name(const char *text);
 const char *path_basename(const char *path);
 int path_dirname_len(const char *filename);
 const char *get_file_extension(int& idx);
+bool parse_time_exceeded(fp_data& fpd);
+bool is_source_filename(const char *filename);
+bool read_list_item(FILE *p_file, string& item, int delim);
+void do_source_file(const char *filename, bool dump);
 
 
 /*
@@ -31,6 +35,8 @@ const char *get_file_extension(int& idx);
 
 void output(fp_data& fpd);
 void output_dump_tokens(fp_data& fpd);
+bool id_types_from_string(const char *str, UINT32& types);
+UINT32 id_types_all(void);
 void output_identifier(
    const char *filename,
    UINT32 line,
@@ -39,6 +45,18 @@ void output_identifier(
    id_type type,
    id_sub_type sub_type,
    const char *identifier);
+void output_flush(void);
+bool output_format_from_string(const char *str, output_format& format);
+void format_identifier(
+   string& out,
+   output_format format,
+   const char *filename,
+   UINT32 line,
+   UINT32 column_start,
+   const char *scope,
+   id_type type,
+   id_sub_type sub_type,
+   const char *identifier);
 
 
 /*
@@ -133,10 +151,22 @@ void assign_scope(fp_data& fpd);
  */
 bool index_open(const char *index_file, bool create);
 bool index_close(void);
+bool index_save(void);
+void index_autotune(const char *index_file, bool indexing);
+bool index_reshard(const char *index_file, int count);
+bool index_merge(const char *index_file, const deque<string>& inputs);
+bool index_maintain(void);
+void index_report(const char *index_file, FILE *out);
+bool index_in_partition(const char *filename);
+bool index_create_lookup_indexes(void);
+bool index_trim_cache(void);
 bool index_prepare_for_analysis(void);
 void index_end_analysis(void);
 bool index_prune_files(void);
 bool index_prepare_for_file(fp_data& fpd);
+bool index_remove_filename(const char *filename);
+void index_begin_batch(void);
+void index_end_batch(void);
 void index_begin_file(fp_data& fpd);
 void index_end_file(fp_data& fpd);
 bool index_insert_entry(
@@ -149,7 +179,81 @@ bool index_insert_entry(
    const char *identifier);
 bool index_lookup_identifier(
    const char *identifier,
-   id_sub_type sub_type);
+   const lookup_options& options);
+bool index_lookup_identifiers(
+   const deque<string>& names,
+   const lookup_options& options);
+bool index_lookup_position(
+   const char *filename,
+   UINT32 line,
+   UINT32 column,
+   const lookup_options& options);
+index_reader *index_reader_open(const char *index_file);
+void index_reader_close(index_reader *rd);
+bool index_reader_lookup(
+   index_reader *rd,
+   const char *identifier,
+   const lookup_options& options,
+   string& out);
+
+
+/*
+ * mapped_index.cpp
+ */
+bool mapped_index_export(const char *filename);
+mapped_index *mapped_index_open(const char *filename);
+void mapped_index_close(mapped_index *mi);
+bool mapped_index_lookup(mapped_index *mi, const char *pattern, lookup_options& options);
+
+
+/*
+ * stats.cpp
+ */
+double wall_clock(void);
+void stats_enable(bool per_file);
+bool stats_enabled(void);
+void stats_phase_begin(stats_phase phase);
+void stats_phase_end(stats_phase phase);
+void stats_begin_file(const char *filename);
+void stats_add_bytes(UINT64 bytes);
+void stats_add_tokens(UINT64 tokens);
+void stats_add_entry(void);
+void stats_add_degraded(int degraded);
+void stats_end_file(int result);
+void stats_report(FILE *text, FILE *json);
+string degraded_reasons(int degraded);
+void json_string(FILE *f, const char *str);
+
+
+/*
+ * trace.cpp
+ */
+void trace_enable(const char *filename);
+void trace_begin(const char *name, const char *arg = NULL);
+void trace_end(const char *name);
+bool trace_flush(void);
+bool trace_write(void);
+
+
+/*
+ * crawl.cpp
+ */
+void crawl_start(const deque<string>& roots, const deque<string>& excludes, int threads);
+bool crawl_next(string& filename);
+void crawl_finish(void);
+
+
+/*
+ * watch.cpp
+ */
+bool watch_run(const deque<string>& dirs, int debounce_ms, bool dump);
+
+
+/*
+ * server.cpp
+ */
+bool server_run(const char *index_file, const char *socket_path, int readers);
+bool client_run(const char *socket_path, const char *request);
 
 
 /* Options we couldn't quite get rid of */
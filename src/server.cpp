@@ -0,0 +1,465 @@
+/**
+ * @file server.cpp
+ * Serves identifier lookups over a Unix domain socket, so the index stays
+ * open and its pages stay cached between lookups.
+ *
+ * The protocol is line based. Each request is a single line:
+ *
+ *    <kinds> <limit> <pattern>
+ *
+ * where kinds is "all" or a comma separated list of "decls", "defs" and
+ * "refs", limit is the maximum number of matches (0 for no limit) and
+ * pattern is the identifier glob pattern. The response is the matches in
+ * the same format as a command line lookup, terminated by an empty line.
+ * A request that fails gets a single "error: <message>" line instead of
+ * the matches.
+ * A client may send any number of requests on a connection.
+ *
+ * Connections are served by a pool of threads that each have their own
+ * read-only connections to the shards of the index.
+ *
+ * @author  Thomas Thorsen
+ * @license GPL v2+
+ */
+#include "toks_types.h"
+#include "prototypes.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <deque>
+
+#ifndef WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+struct server_state
+{
+   const char      *index_file;
+   pthread_mutex_t lock;
+   pthread_cond_t  cond;
+   deque<int>      pending;    /* accepted connections */
+   int             *active;    /* connection served by each reader, or -1 */
+   bool            stopping;
+};
+
+static server_state server;
+static volatile sig_atomic_t server_stop;
+
+
+static void server_signal(int sig)
+{
+   server_stop = 1;
+}
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+   while (len > 0)
+   {
+      ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+
+      if (n < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      data += n;
+      len -= n;
+   }
+   return true;
+}
+
+/* Parses the kinds of a request into a bit mask of (1 << id_sub_type) */
+static bool parse_kinds(const char *kinds, UINT32& mask)
+{
+   string str(kinds);
+   size_t pos = 0;
+
+   mask = 0;
+   while (pos <= str.size())
+   {
+      size_t end = str.find(',', pos);
+      string kind;
+
+      if (end == string::npos)
+         end = str.size();
+      kind = str.substr(pos, end - pos);
+
+      if (kind == "all")
+         mask |= IST_ALL_BITS;
+      else if (kind == "refs")
+         mask |= (1U << IST_REFERENCE);
+      else if (kind == "defs")
+         mask |= (1U << IST_DEFINITION);
+      else if (kind == "decls")
+         mask |= (1U << IST_DECLARATION);
+      else
+         return false;
+
+      pos = end + 1;
+   }
+   return true;
+}
+
+/* Handles a single request line, appends the matches or error to out */
+static void server_request(index_reader *rd, char *line, string& out)
+{
+   char *kinds, *limit_str, *pattern, *end;
+   lookup_options options;
+   int limit;
+
+   kinds = strtok_r(line, " ", &pattern);
+   limit_str = strtok_r(NULL, " ", &pattern);
+
+   if ((kinds == NULL) || (limit_str == NULL) || (*pattern == 0))
+   {
+      out += "error: expected <kinds> <limit> <pattern>\n";
+      return;
+   }
+   memset(&options, 0, sizeof(options));
+   if (!parse_kinds(kinds, options.kinds))
+   {
+      out += "error: unknown kind in ";
+      out += kinds;
+      out += "\n";
+      return;
+   }
+   limit = strtol(limit_str, &end, 10);
+   if ((*end != 0) || (limit < 0))
+   {
+      out += "error: bad limit\n";
+      return;
+   }
+   options.limit = (limit > 0) ? limit : -1;
+
+   if (!index_reader_lookup(rd, pattern, options, out))
+   {
+      out = "error: lookup failed\n";
+   }
+}
+
+/* Serves the requests of a connection until the client closes it */
+static void server_connection(index_reader *rd, int fd)
+{
+   string buffer, out;
+   char data[4096];
+
+   for (;;)
+   {
+      ssize_t n = recv(fd, data, sizeof(data), 0);
+      size_t start = 0, nl;
+
+      if (n < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+      if (n == 0)
+      {
+         break;
+      }
+
+      buffer.append(data, n);
+      while ((nl = buffer.find('\n', start)) != string::npos)
+      {
+         string line = buffer.substr(start, nl - start);
+
+         if (!line.empty() && (line[line.size() - 1] == '\r'))
+         {
+            line.erase(line.size() - 1);
+         }
+         out.clear();
+         server_request(rd, &line[0], out);
+         out += '\n';
+         if (!send_all(fd, out.data(), out.size()))
+         {
+            return;
+         }
+         start = nl + 1;
+      }
+      buffer.erase(0, start);
+   }
+}
+
+static void *server_reader(void *arg)
+{
+   int id = (int) (size_t) arg;
+   index_reader *rd = index_reader_open(server.index_file);
+
+   for (;;)
+   {
+      int fd;
+
+      pthread_mutex_lock(&server.lock);
+      while (server.pending.empty() && !server.stopping)
+      {
+         pthread_cond_wait(&server.cond, &server.lock);
+      }
+      if (server.pending.empty())
+      {
+         pthread_mutex_unlock(&server.lock);
+         break;
+      }
+      fd = server.pending.front();
+      server.pending.pop_front();
+      server.active[id] = fd;
+      pthread_mutex_unlock(&server.lock);
+
+      if (rd != NULL)
+      {
+         server_connection(rd, fd);
+      }
+      else
+      {
+         static const char error[] = "error: index not available\n\n";
+         (void) send_all(fd, error, sizeof(error) - 1);
+      }
+
+      pthread_mutex_lock(&server.lock);
+      server.active[id] = -1;
+      pthread_mutex_unlock(&server.lock);
+      close(fd);
+   }
+
+   if (rd != NULL)
+   {
+      index_reader_close(rd);
+   }
+   return NULL;
+}
+
+
+/**
+ * Serves lookups on a Unix domain socket until SIGINT or SIGTERM.
+ *
+ * @param index_file   The index to serve
+ * @param socket_path  The path of the socket, an existing file is replaced
+ * @param readers      The number of reader threads
+ */
+bool server_run(const char *index_file, const char *socket_path, int readers)
+{
+   struct sockaddr_un addr;
+   struct sigaction sa;
+   vector<pthread_t> threads;
+   int listen_fd;
+
+   if (strlen(socket_path) >= sizeof(addr.sun_path))
+   {
+      LOG_FMT(LERR, "%s: socket path too long: %s\n", __func__, socket_path);
+      return false;
+   }
+
+   listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listen_fd < 0)
+   {
+      LOG_FMT(LERR, "%s: socket() failed: %s (%d)\n", __func__, strerror(errno), errno);
+      return false;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, socket_path);
+   (void) unlink(socket_path);
+
+   if ((bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) ||
+       (listen(listen_fd, 64) != 0))
+   {
+      LOG_FMT(LERR, "%s: bind(%s) failed: %s (%d)\n",
+              __func__, socket_path, strerror(errno), errno);
+      close(listen_fd);
+      return false;
+   }
+
+   /* No SA_RESTART, so accept() returns when asked to stop */
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = server_signal;
+   sigemptyset(&sa.sa_mask);
+   (void) sigaction(SIGINT, &sa, NULL);
+   (void) sigaction(SIGTERM, &sa, NULL);
+
+   if (readers < 1)
+   {
+      readers = 1;
+   }
+
+   server.index_file = index_file;
+   pthread_mutex_init(&server.lock, NULL);
+   pthread_cond_init(&server.cond, NULL);
+   server.active = new int[readers];
+   server.stopping = false;
+
+   for (int i = 0; i < readers; i++)
+   {
+      pthread_t thread;
+
+      server.active[i] = -1;
+      if (pthread_create(&thread, NULL, server_reader, (void *) (size_t) i) == 0)
+      {
+         threads.push_back(thread);
+      }
+   }
+
+   LOG_FMT(LNOTE, "Serving %s on %s with %d readers\n",
+           index_file != NULL ? index_file : "TOKS", socket_path, (int) threads.size());
+
+   while (!server_stop)
+   {
+      int fd = accept(listen_fd, NULL, NULL);
+
+      if (fd < 0)
+      {
+         if ((errno != EINTR) && (errno != ECONNABORTED))
+         {
+            LOG_FMT(LERR, "%s: accept() failed: %s (%d)\n", __func__, strerror(errno), errno);
+            break;
+         }
+         continue;
+      }
+
+      pthread_mutex_lock(&server.lock);
+      server.pending.push_back(fd);
+      pthread_cond_signal(&server.cond);
+      pthread_mutex_unlock(&server.lock);
+   }
+
+   close(listen_fd);
+   (void) unlink(socket_path);
+
+   /* Drop queued connections and wake up readers waiting on clients */
+   pthread_mutex_lock(&server.lock);
+   server.stopping = true;
+   while (!server.pending.empty())
+   {
+      close(server.pending.front());
+      server.pending.pop_front();
+   }
+   for (int i = 0; i < readers; i++)
+   {
+      if (server.active[i] >= 0)
+      {
+         (void) shutdown(server.active[i], SHUT_RDWR);
+      }
+   }
+   pthread_cond_broadcast(&server.cond);
+   pthread_mutex_unlock(&server.lock);
+
+   for (size_t i = 0; i < threads.size(); i++)
+   {
+      pthread_join(threads[i], NULL);
+   }
+
+   delete[] server.active;
+   pthread_cond_destroy(&server.cond);
+   pthread_mutex_destroy(&server.lock);
+
+   return true;
+}
+
+
+/**
+ * Sends a single request to a server and writes the response to stdout.
+ * Returns false if the request could not be sent or failed.
+ */
+bool client_run(const char *socket_path, const char *request)
+{
+   struct sockaddr_un addr;
+   string response;
+   char data[4096];
+   int fd;
+
+   if (strlen(socket_path) >= sizeof(addr.sun_path))
+   {
+      LOG_FMT(LERR, "%s: socket path too long: %s\n", __func__, socket_path);
+      return false;
+   }
+
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0)
+   {
+      LOG_FMT(LERR, "%s: socket() failed: %s (%d)\n", __func__, strerror(errno), errno);
+      return false;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, socket_path);
+
+   if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+   {
+      LOG_FMT(LERR, "%s: connect(%s) failed: %s (%d)\n",
+              __func__, socket_path, strerror(errno), errno);
+      close(fd);
+      return false;
+   }
+
+   if (!send_all(fd, request, strlen(request)) || !send_all(fd, "\n", 1))
+   {
+      LOG_FMT(LERR, "%s: send failed: %s (%d)\n", __func__, strerror(errno), errno);
+      close(fd);
+      return false;
+   }
+
+   /* Read until the empty line that ends the response */
+   for (;;)
+   {
+      ssize_t n = recv(fd, data, sizeof(data), 0);
+
+      if ((n < 0) && (errno == EINTR))
+      {
+         continue;
+      }
+      if (n <= 0)
+      {
+         break;
+      }
+      response.append(data, n);
+      if ((response.size() >= 2) &&
+          (response.compare(response.size() - 2, 2, "\n\n") == 0))
+      {
+         break;
+      }
+      if (response == "\n")
+      {
+         break;
+      }
+   }
+   close(fd);
+
+   if (response.compare(0, 7, "error: ") == 0)
+   {
+      LOG_FMT(LERR, "%s", response.c_str());
+      return false;
+   }
+
+   /* Strip the terminating empty line */
+   if (!response.empty())
+   {
+      response.erase(response.size() - 1);
+   }
+   fwrite(response.data(), 1, response.size(), stdout);
+
+   return true;
+}
+
+#else /* WIN32 */
+
+bool server_run(const char *index_file, const char *socket_path, int readers)
+{
+   LOG_FMT(LERR, "%s: not supported on this platform\n", __func__);
+   return false;
+}
+
+bool client_run(const char *socket_path, const char *request)
+{
+   LOG_FMT(LERR, "%s: not supported on this platform\n", __func__);
+   return false;
+}
+
+#endif
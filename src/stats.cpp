@@ -0,0 +1,402 @@
+/**
+ * @file stats.cpp
+ * Collects per-phase timing and throughput statistics.
+ *
+ * @author  Thomas Thorsen
+ * @license GPL v2+
+ */
+#include "toks_types.h"
+#include "prototypes.h"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+static const char *phase_names[] =
+{
+   "decode_file",
+   "md5",
+   "tokenize",
+   "tokenize_cleanup",
+   "brace_cleanup",
+   "fix_symbols",
+   "combine_labels",
+   "assign_scope",
+   "output",
+   "index_lookup_file",
+   "index_insert",
+   "index_commit",
+   "index_prune",
+};
+
+struct phase_time
+{
+   double wall;
+   double cpu;
+   UINT64 calls;
+};
+
+struct file_stats
+{
+   string     filename;
+   int        result;
+   UINT64     bytes;
+   UINT64     tokens;
+   UINT64     entries;
+   int        degraded;      /* DR_xxx */
+   phase_time phases[SP_COUNT];
+};
+
+struct run_stats
+{
+   bool               enabled;
+   bool               per_file;
+   double             start_wall;
+   double             start_cpu;
+   double             begin_wall[SP_COUNT];
+   double             begin_cpu[SP_COUNT];
+   UINT64             files_parsed;
+   UINT64             files_skipped;
+   UINT64             files_failed;
+   vector<file_stats> files_degraded;
+   file_stats         total;
+   file_stats         file;
+   vector<file_stats> files;
+};
+
+static struct run_stats stats;
+
+
+/**
+ * Returns a monotonic wall clock time in seconds.
+ */
+double wall_clock(void)
+{
+#ifdef WIN32
+   return (double) clock() / CLOCKS_PER_SEC;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static double now_cpu(bool thread)
+{
+#ifdef WIN32
+   return (double) clock() / CLOCKS_PER_SEC;
+#else
+   struct timespec ts;
+   clock_gettime(thread ? CLOCK_THREAD_CPUTIME_ID : CLOCK_PROCESS_CPUTIME_ID, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+static void clear_file_stats(file_stats& fs)
+{
+   fs.filename.clear();
+   fs.result = 0;
+   fs.bytes = 0;
+   fs.tokens = 0;
+   fs.entries = 0;
+   fs.degraded = DR_NONE;
+   memset(fs.phases, 0, sizeof(fs.phases));
+}
+
+
+void stats_enable(bool per_file)
+{
+   stats.enabled = true;
+   stats.per_file = per_file;
+   stats.start_wall = wall_clock();
+   stats.start_cpu = now_cpu(false);
+   clear_file_stats(stats.total);
+   clear_file_stats(stats.file);
+}
+
+bool stats_enabled(void)
+{
+   return stats.enabled;
+}
+
+/* The phases are also recorded as trace spans, except for the inserts */
+void stats_phase_begin(stats_phase phase)
+{
+   if (phase != SP_INDEX_INSERT)
+   {
+      trace_begin(phase_names[phase]);
+   }
+   if (stats.enabled)
+   {
+      stats.begin_wall[phase] = wall_clock();
+      stats.begin_cpu[phase] = now_cpu(true);
+   }
+}
+
+void stats_phase_end(stats_phase phase)
+{
+   if (phase != SP_INDEX_INSERT)
+   {
+      trace_end(phase_names[phase]);
+   }
+   if (stats.enabled)
+   {
+      double wall = wall_clock() - stats.begin_wall[phase];
+      double cpu = now_cpu(true) - stats.begin_cpu[phase];
+
+      stats.file.phases[phase].wall += wall;
+      stats.file.phases[phase].cpu += cpu;
+      stats.file.phases[phase].calls++;
+      stats.total.phases[phase].wall += wall;
+      stats.total.phases[phase].cpu += cpu;
+      stats.total.phases[phase].calls++;
+   }
+}
+
+void stats_begin_file(const char *filename)
+{
+   if (stats.enabled)
+   {
+      clear_file_stats(stats.file);
+      stats.file.filename = filename;
+   }
+}
+
+void stats_add_bytes(UINT64 bytes)
+{
+   stats.file.bytes += bytes;
+   stats.total.bytes += bytes;
+}
+
+void stats_add_tokens(UINT64 tokens)
+{
+   stats.file.tokens += tokens;
+   stats.total.tokens += tokens;
+}
+
+void stats_add_entry(void)
+{
+   stats.file.entries++;
+   stats.total.entries++;
+}
+
+void stats_add_degraded(int degraded)
+{
+   stats.file.degraded |= degraded;
+}
+
+/**
+ * Completes the statistics of the current file.
+ *
+ * @param result  1 if the file was parsed, 0 if it was unchanged and
+ *                -1 if it could not be read
+ */
+void stats_end_file(int result)
+{
+   if (stats.enabled)
+   {
+      if (result > 0)
+      {
+         stats.files_parsed++;
+         if (stats.file.degraded != DR_NONE)
+         {
+            stats.files_degraded.push_back(stats.file);
+         }
+      }
+      else if (result == 0)
+      {
+         stats.files_skipped++;
+      }
+      else
+      {
+         stats.files_failed++;
+      }
+
+      if (stats.per_file)
+      {
+         stats.file.result = result;
+         stats.files.push_back(stats.file);
+      }
+   }
+}
+
+
+static const char *result_name(int result)
+{
+   return (result > 0) ? "parsed" : (result == 0) ? "unchanged" : "failed";
+}
+
+/**
+ * Names the reasons a file was analyzed in a degraded mode, comma separated.
+ */
+string degraded_reasons(int degraded)
+{
+   static const char *const names[] = { "file size", "line length", "tokens", "parse time" };
+   string reasons;
+
+   for (int i = 0; i < (int) ARRAY_SIZE(names); i++)
+   {
+      if ((degraded & (1 << i)) != 0)
+      {
+         if (!reasons.empty())
+         {
+            reasons += ",";
+         }
+         reasons += names[i];
+      }
+   }
+   return reasons;
+}
+
+static double per_sec(double count, double secs)
+{
+   return (secs > 0) ? (count / secs) : 0;
+}
+
+/**
+ * Writes a string as a quoted and escaped JSON string.
+ */
+void json_string(FILE *f, const char *str)
+{
+   fputc('"', f);
+   for (; *str != 0; str++)
+   {
+      unsigned char ch = (unsigned char) *str;
+
+      if ((ch == '"') || (ch == '\\'))
+      {
+         fprintf(f, "\\%c", ch);
+      }
+      else if (ch < 0x20)
+      {
+         fprintf(f, "\\u%04x", ch);
+      }
+      else
+      {
+         fputc(ch, f);
+      }
+   }
+   fputc('"', f);
+}
+
+static void json_phases(FILE *f, const phase_time *phases)
+{
+   fprintf(f, "{");
+   for (int i = 0; i < SP_COUNT; i++)
+   {
+      fprintf(f, "%s\"%s\":{\"wall\":%.6f,\"cpu\":%.6f,\"calls\":%" PRIu64 "}",
+              (i > 0) ? "," : "", phase_names[i],
+              phases[i].wall, phases[i].cpu, phases[i].calls);
+   }
+   fprintf(f, "}");
+}
+
+static void text_phases(FILE *f, const phase_time *phases)
+{
+   fprintf(f, "  %-18s %12s %12s %12s\n", "phase", "wall (s)", "cpu (s)", "calls");
+   for (int i = 0; i < SP_COUNT; i++)
+   {
+      fprintf(f, "  %-18s %12.6f %12.6f %12" PRIu64 "\n",
+              phase_names[i], phases[i].wall, phases[i].cpu, phases[i].calls);
+   }
+}
+
+/**
+ * Writes the collected statistics as text and/or JSON.
+ *
+ * @param text  The stream for the text report or NULL
+ * @param json  The stream for the JSON report or NULL
+ */
+void stats_report(FILE *text, FILE *json)
+{
+   double wall = wall_clock() - stats.start_wall;
+   double cpu = now_cpu(false) - stats.start_cpu;
+   UINT64 files = stats.files_parsed + stats.files_skipped + stats.files_failed;
+   double mbytes = stats.total.bytes / (1024.0 * 1024.0);
+
+   if (!stats.enabled)
+   {
+      return;
+   }
+
+   if (text != NULL)
+   {
+      fprintf(text, "Statistics:\n");
+      fprintf(text, "  files: %" PRIu64 " parsed, %" PRIu64 " unchanged, %" PRIu64 " failed, %d degraded\n",
+              stats.files_parsed, stats.files_skipped, stats.files_failed, (int) stats.files_degraded.size());
+      for (size_t i = 0; i < stats.files_degraded.size(); i++)
+      {
+         fprintf(text, "  degraded: %s (%s)\n", stats.files_degraded[i].filename.c_str(),
+                 degraded_reasons(stats.files_degraded[i].degraded).c_str());
+      }
+      fprintf(text, "  read: %.2f MB, tokens: %" PRIu64 ", entries: %" PRIu64 "\n",
+              mbytes, stats.total.tokens, stats.total.entries);
+      fprintf(text, "  time: %.3f s wall, %.3f s cpu\n", wall, cpu);
+      fprintf(text, "  rate: %.1f files/s, %.2f MB/s, %.0f tokens/s, %.0f entries/s\n",
+              per_sec(files, wall), per_sec(mbytes, wall),
+              per_sec(stats.total.tokens, wall), per_sec(stats.total.entries, wall));
+      text_phases(text, stats.total.phases);
+
+      for (size_t i = 0; i < stats.files.size(); i++)
+      {
+         const file_stats& fs = stats.files[i];
+         double file_wall = 0;
+
+         for (int p = 0; p < SP_COUNT; p++)
+         {
+            if (p != SP_INDEX_INSERT)   /* nested in output */
+            {
+               file_wall += fs.phases[p].wall;
+            }
+         }
+         fprintf(text, "  %s: %s, %" PRIu64 " bytes, %" PRIu64 " tokens, %" PRIu64 " entries, %.6f s\n",
+                 fs.filename.c_str(), result_name(fs.result),
+                 fs.bytes, fs.tokens, fs.entries, file_wall);
+      }
+   }
+
+   if (json != NULL)
+   {
+      fprintf(json, "{\"files\":{\"parsed\":%" PRIu64 ",\"unchanged\":%" PRIu64 ",\"failed\":%" PRIu64 "},",
+              stats.files_parsed, stats.files_skipped, stats.files_failed);
+      fprintf(json, "\"bytes\":%" PRIu64 ",\"tokens\":%" PRIu64 ",\"entries\":%" PRIu64 ",",
+              stats.total.bytes, stats.total.tokens, stats.total.entries);
+      fprintf(json, "\"wall\":%.6f,\"cpu\":%.6f,", wall, cpu);
+      fprintf(json, "\"rate\":{\"files_per_sec\":%.3f,\"mb_per_sec\":%.3f,\"tokens_per_sec\":%.1f,\"entries_per_sec\":%.1f},",
+              per_sec(files, wall), per_sec(mbytes, wall),
+              per_sec(stats.total.tokens, wall), per_sec(stats.total.entries, wall));
+      fprintf(json, "\"phases\":");
+      json_phases(json, stats.total.phases);
+
+      fprintf(json, ",\"degraded\":[");
+      for (size_t i = 0; i < stats.files_degraded.size(); i++)
+      {
+         fprintf(json, "%s{\"filename\":", (i > 0) ? "," : "");
+         json_string(json, stats.files_degraded[i].filename.c_str());
+         fprintf(json, ",\"reasons\":");
+         json_string(json, degraded_reasons(stats.files_degraded[i].degraded).c_str());
+         fprintf(json, "}");
+      }
+      fprintf(json, "]");
+
+      if (stats.per_file)
+      {
+         fprintf(json, ",\"per_file\":[");
+         for (size_t i = 0; i < stats.files.size(); i++)
+         {
+            const file_stats& fs = stats.files[i];
+
+            fprintf(json, "%s{\"filename\":", (i > 0) ? "," : "");
+            json_string(json, fs.filename.c_str());
+            fprintf(json, ",\"result\":\"%s\",\"bytes\":%" PRIu64 ",\"tokens\":%" PRIu64 ",\"entries\":%" PRIu64 ",\"phases\":",
+                    result_name(fs.result), fs.bytes, fs.tokens, fs.entries);
+            json_phases(json, fs.phases);
+            fprintf(json, "}");
+         }
+         fprintf(json, "]");
+      }
+      fprintf(json, "}\n");
+   }
+}
@@ -40,8 +40,11 @@ static int language_from_filename(const char *filename);
 static const char *language_to_string(int lang);
 static void toks_start(fp_data& fpd);
 static void toks_end(fp_data& fpd);
-static void do_source_file(const char *filename_in, bool dump);
-static bool process_source_list(const char *source_list, deque<string>& source_files);
+static void check_file_limits(fp_data& fpd);
+static void check_token_limit(fp_data& fpd);
+static bool process_source_list(const char *source_list, int delim, bool dump);
+static bool process_id_list(const char *id_list, deque<string>& identifiers);
+static void write_stats(bool text, const char *json_file);
 
 
 /**
@@ -111,16 +114,96 @@ static void usage_exit(const char *msg, const char *argv0, int code)
            "\n"
            "Basic Options:\n"
            " -F <file>     : Read files to process from file, one filename per line (- is stdin)\n"
-           " -i <file>     : Use file as index (default: TOKS)\n"
+           " -0            : The filenames in the -F file are separated by NUL (find -print0)\n"
+           " -r <dir>      : Process the source files below dir, can be given several times\n"
+           " --exclude <pattern> : Skip files and directories matching the pattern with -r,\n"
+           "                 can be given several times (.gitignore files are also honoured)\n"
+           " --threads <n> : Number of threads reading directories with -r and checking\n"
+           "                 for removed files (default: 4)\n"
+           " --no-prune    : Don't remove files that no longer exist from the index\n"
+           " --parse-cache <n> : Keep the entries of up to n contents of removed or\n"
+           "                 changed files, for files that get the same contents later\n"
+           " -i <file>     : Use file as index (default: TOKS), or a directory of shards\n"
+           " --shards <n>  : Create a new index as a directory of n shards, files are\n"
+           "                 assigned to the shards by a hash of their path\n"
+           " --reshard <n> : Change the number of shards of the index to n (1 for a file)\n"
+           " --in-memory-build : Update the index in memory and write it in one pass at\n"
+           "                 the end, the index on disk is not changed until then\n"
+           " --wal         : Switch the index to write-ahead logging, so lookups see the\n"
+           "                 last committed state during an update and a crash can't\n"
+           "                 corrupt it (kept for later runs)\n"
+           " --shard <i/N> : Only index the files in partition i (from 0) of N, decided by a\n"
+           "                 hash of their path, and only prune those (see --merge)\n"
+           " --merge <out> : Merge the indexes given instead of files into out, a file in\n"
+           "                 several of them is taken from the one that analyzed it last\n"
+           " --maintain    : Rebuild the lookup indexes, reclaim free pages and update the\n"
+           "                 query planner statistics of the index, then --index-stats\n"
+           " --index-stats : Print the rows and pages of the tables of the index, its free\n"
+           "                 pages and the bytes per entry\n"
            " -o <file>     : Redirect output to file\n"
+           " --config <file> : Load settings from file, see Storage Options\n"
            " -l <language> : Language override: C, CPP, D, CS, JAVA, PAWN, OC, OC+\n"
            " -t            : Load a file with types (usually not needed)\n"
+           " --decls-only  : Skip function bodies, only index definitions/declarations\n"
+           " --watch       : Index the source files in the directories given instead of files,\n"
+           "                 and keep updating the index when they change (Linux only)\n"
+           " --debounce <ms> : Time without changes before updating the index (default: 500)\n"
+           "\n"
+           "File Limit Options (files exceeding a limit are analyzed in a degraded mode):\n"
+           " --max-file-size <bytes>  : Only index definitions/declarations of larger files\n"
+           " --max-line-length <n>    : Same, for files with longer lines (likely generated)\n"
+           " --max-tokens <n>         : Same, for files with more tokens\n"
+           " --max-parse-time <ms>    : Only index identifiers without scope for slower files\n"
+           "\n"
+           "Index Content Options (fixed when the index is created):\n"
+           " --ref-types <types>      : Only index references of the given types, comma separated\n"
+           "                            (eg. FUNCTION,MACRO,TYPE or -IDENTIFIER,-VAR or NONE)\n"
+           " --func-ref-types <types> : Same, for all references inside function bodies and\n"
+           "                            parameter lists, whatever they refer to (default:\n"
+           "                            --ref-types)\n"
+           "\n"
+           "Storage Options (also in the [storage] section of the --config file as\n"
+           "page_size, cache_size, mmap_size, temp_store, locking_mode and autotune):\n"
+           " --page-size <bytes>      : Page size of a new index (512 to 65536, a power of two)\n"
+           " --cache-size <KiB>       : Page cache of each shard\n"
+           " --mmap-size <bytes>      : Memory map up to this much of each shard\n"
+           " --temp-store <mode>      : Temporary tables and indexes in: default, file or memory\n"
+           " --exclusive              : Lock the index while indexing (locking_mode=EXCLUSIVE)\n"
+           " --autotune               : Choose the parameters not given from the index size and\n"
+           "                            the available memory (recorded in the index)\n"
            "\n"
            "Lookup Options (can be combined, supports ? and * wildcards):\n"
-           " --id <name>          : Identifier name to search for\n"
+           " --id <name>          : Identifier name to search for, can be given several times\n"
+           " --id-file <file>     : Read identifier names to search for from file, one per line\n"
+           " --at <file:line:col> : Search for the definitions of the identifier at a position\n"
            " --refs               : Show only references\n"
            " --defs               : Show only definitions\n"
            " --decls              : Show only declarations\n"
+           " --limit <n>          : Show at most n matches\n"
+           " --offset <n>         : Skip the first n matches\n"
+           " --defs-first         : Show definitions, then declarations, then references\n"
+           " --near <file>        : Show matches in or close to file in the directory tree first\n"
+           " --type <types>       : Show only identifiers of the given types, comma separated\n"
+           " --scope <pattern>    : Show only matches in the scopes matching pattern (eg. classa{})\n"
+           " --in <path>          : Show only matches in files below path\n"
+           " --format <format>    : Output format: text (default), json (one object per line)\n"
+           "                        or nul (each of the seven fields terminated by NUL)\n"
+           "\n"
+           "Mapped Index Options:\n"
+           " --export-mmap <file> : Write a read-only binary copy of the index to file\n"
+           " --mmap <file>        : Look up in a file written by --export-mmap instead of the index\n"
+           "                        (only --refs, --defs, --decls, --type, --limit and --offset apply)\n"
+           "\n"
+           "Server Options:\n"
+           " --serve <socket>     : Keep the index open and serve lookups on a Unix socket\n"
+           " --readers <n>        : Number of threads serving lookups (default: 4)\n"
+           " --connect <socket>   : Send the lookup to a server instead of opening the index\n"
+           "\n"
+           "Statistics Options:\n"
+           " --stats              : Print timing and throughput statistics to stderr\n"
+           " --stats-json <file>  : Write the statistics as JSON to file (- is stdout)\n"
+           " --stats-per-file     : Include statistics for each file\n"
+           " --trace <file>       : Write a timeline of the analysis in Chrome trace event format\n"
            "\n"
            "Config/Help Options:\n"
            " -h -? --help --usage     : print this message and exit\n"
@@ -135,6 +218,9 @@ static void usage_exit(const char *msg, const char *argv0, int code)
            " toks foo.c\n"
            " toks -L0-2,20-23,51 foo.d\n"
            " toks --id my_identifier\n"
+           " toks --watch src include &\n"
+           " toks --serve /tmp/toks.sock &\n"
+           " toks --connect /tmp/toks.sock --id my_identifier\n"
            "\n"
            ,
            path_basename(argv0));
@@ -167,6 +253,143 @@ static void redir_stdout(const char *output_file)
    }
 }
 
+/**
+ * Sets a storage parameter by its name in the [storage] section of the
+ * config file, returns false for an unknown name or a bad value.
+ */
+static bool storage_set(const char *name, const char *value)
+{
+   storage_options& st = cpd.storage;
+   char *end;
+
+   if (strcmp(name, "page_size") == 0)
+   {
+      long page_size = strtol(value, &end, 10);
+
+      if ((*end != 0) || (page_size < 512) || (page_size > 65536) ||
+          ((page_size & (page_size - 1)) != 0))
+      {
+         return false;
+      }
+      st.page_size = page_size;
+   }
+   else if ((strcmp(name, "cache_size") == 0) || (strcmp(name, "mmap_size") == 0))
+   {
+      long long size = strtoll(value, &end, 10);
+      bool cache = (name[0] == 'c');
+
+      if ((*end != 0) || (size < (cache ? 1 : 0)))
+      {
+         return false;
+      }
+      (cache ? st.cache_size : st.mmap_size) = size;
+   }
+   else if (strcmp(name, "temp_store") == 0)
+   {
+      static const char *const modes[] = { "default", "file", "memory" };
+
+      for (st.temp_store = 0; st.temp_store < (int) ARRAY_SIZE(modes); st.temp_store++)
+      {
+         if (strcasecmp(value, modes[st.temp_store]) == 0)
+         {
+            return true;
+         }
+      }
+      st.temp_store = -1;
+      return false;
+   }
+   else if (strcmp(name, "locking_mode") == 0)
+   {
+      if (strcasecmp(value, "exclusive") == 0)
+      {
+         st.exclusive = 1;
+      }
+      else if (strcasecmp(value, "normal") == 0)
+      {
+         st.exclusive = 0;
+      }
+      else
+      {
+         return false;
+      }
+   }
+   else if (strcmp(name, "autotune") == 0)
+   {
+      st.autotune = (strcmp(value, "1") == 0) || (strcasecmp(value, "yes") == 0) ||
+                    (strcasecmp(value, "true") == 0);
+   }
+   else
+   {
+      return false;
+   }
+   return true;
+}
+
+
+/**
+ * Loads a config file with "name = value" lines in sections started by
+ * "[section]" lines. Only the [storage] section is known.
+ */
+static bool load_config_file(const char *filename)
+{
+   FILE *pf;
+   char buf[256];
+   char *ptr;
+   int  line_no = 0;
+   bool storage = false;
+
+   pf = fopen(filename, "r");
+   if (pf == NULL)
+   {
+      LOG_FMT(LERR, "%s: fopen(%s) failed: %s (%d)\n",
+              __func__, filename, strerror(errno), errno);
+      return false;
+   }
+
+   while (fgets(buf, sizeof(buf), pf) != NULL)
+   {
+      char *args[3];
+      int  argc;
+
+      line_no++;
+
+      /* remove comments */
+      if ((ptr = strchr(buf, '#')) != NULL)
+      {
+         *ptr = 0;
+      }
+      if ((ptr = strchr(buf, '=')) != NULL)
+      {
+         *ptr = ' ';
+      }
+
+      argc       = Args::SplitLine(buf, args, ARRAY_SIZE(args) - 1);
+      args[argc] = 0;
+
+      if ((argc == 1) && (args[0][0] == '['))
+      {
+         storage = (strcmp(args[0], "[storage]") == 0);
+      }
+      else if ((argc == 2) && (ptr != NULL))
+      {
+         if (storage && !storage_set(args[0], args[1]))
+         {
+            LOG_FMT(LWARN, "%s:%d Invalid storage parameter '%s = %s'\n",
+                    filename, line_no, args[0], args[1]);
+         }
+      }
+      else if (argc > 0)
+      {
+         LOG_FMT(LWARN, "%s:%d Invalid line (starts with '%s')\n",
+                 filename, line_no, args[0]);
+      }
+   }
+
+   fclose(pf);
+   return true;
+}
+
+
 int main(int argc, char *argv[])
 {
    const char *output_file, *source_list, *index_file;
@@ -175,7 +398,24 @@ int main(int argc, char *argv[])
    const char *p_arg;
    bool dump = false;
    const char *identifier;
+   deque<string> identifiers;
+   const char *at;
+   string at_file;
+   UINT32 at_line = 0, at_column = 0;
+   const char *stats_json;
+   const char *serve_socket, *connect_socket;
+   const char *export_mmap, *mapped_file;
+   const char *merge_file;
+   int readers, debounce, reshard;
+   lookup_options lookup;
    bool refs, defs, decls;
+   bool watch;
+   int list_delim;
+   bool prune;
+   deque<string> crawl_roots, excludes;
+   bool stats;
+   bool in_memory_build;
+   bool maintain, index_stats;
 
    Args arg(argc, argv);
 
@@ -231,18 +471,257 @@ int main(int argc, char *argv[])
       }
    }
 
+   if (arg.Present("--decls-only"))
+   {
+      cpd.mode = PM_DECLS_ONLY;
+   }
+
+   /* Check for limits on files to analyze in full */
+   if ((p_arg = arg.Param("--max-file-size")) != NULL)
+   {
+      cpd.max_file_size = strtoull(p_arg, NULL, 10);
+   }
+   if ((p_arg = arg.Param("--max-line-length")) != NULL)
+   {
+      cpd.max_line_length = strtoul(p_arg, NULL, 10);
+   }
+   if ((p_arg = arg.Param("--max-tokens")) != NULL)
+   {
+      cpd.max_tokens = strtoul(p_arg, NULL, 10);
+   }
+   if ((p_arg = arg.Param("--max-parse-time")) != NULL)
+   {
+      cpd.max_parse_time = strtoul(p_arg, NULL, 10) / 1000.0;
+   }
+
+   /* Check for restrictions on the references to index */
+   cpd.ref_types = id_types_all();
+   if ((p_arg = arg.Param("--ref-types")) != NULL)
+   {
+      if (!id_types_from_string(p_arg, cpd.ref_types))
+      {
+         usage_exit(NULL, argv[0], EXIT_FAILURE);
+      }
+      cpd.ref_types_set = true;
+   }
+   cpd.func_ref_types = cpd.ref_types;
+   if ((p_arg = arg.Param("--func-ref-types")) != NULL)
+   {
+      if (!id_types_from_string(p_arg, cpd.func_ref_types))
+      {
+         usage_exit(NULL, argv[0], EXIT_FAILURE);
+      }
+      cpd.ref_types_set = true;
+   }
+
+   if ((p_arg = arg.Param("--parse-cache")) != NULL)
+   {
+      cpd.parse_cache = atoi(p_arg);
+   }
+
+   watch = arg.Present("--watch");
+   debounce = 500;
+   if ((p_arg = arg.Param("--debounce")) != NULL)
+   {
+      debounce = atoi(p_arg);
+   }
+
+   idx = 0;
+   while ((p_arg = arg.Params("-r", idx)) != NULL)
+   {
+      crawl_roots.push_back(p_arg);
+   }
+   idx = 0;
+   while ((p_arg = arg.Params("--exclude", idx)) != NULL)
+   {
+      excludes.push_back(p_arg);
+   }
+   cpd.threads = 4;
+   if ((p_arg = arg.Param("--threads")) != NULL)
+   {
+      cpd.threads = atoi(p_arg);
+   }
+   prune = !arg.Present("--no-prune");
+
    source_list = arg.Param("-F");
+   list_delim = arg.Present("-0") ? 0 : '\n';
    output_file = arg.Param("-o");
    index_file = arg.Param("-i");
+   if ((p_arg = arg.Param("--shards")) != NULL)
+   {
+      cpd.shard_count = atoi(p_arg);
+      if (cpd.shard_count < 1)
+      {
+         usage_exit("Expected --shards n with n of at least 1", argv[0], EXIT_FAILURE);
+      }
+   }
+   if ((p_arg = arg.Param("--shard")) != NULL)
+   {
+      if ((sscanf(p_arg, "%u/%u", &cpd.partition, &cpd.partitions) != 2) ||
+          (cpd.partition >= cpd.partitions))
+      {
+         usage_exit("Expected --shard i/N with i from 0 to N-1", argv[0], EXIT_FAILURE);
+      }
+   }
+   cpd.wal = arg.Present("--wal");
+
+   /* Storage parameters, from the config file and then the options */
+   cpd.storage.page_size = -1;
+   cpd.storage.cache_size = -1;
+   cpd.storage.mmap_size = -1;
+   cpd.storage.temp_store = -1;
+   cpd.storage.exclusive = -1;
+   if (((p_arg = arg.Param("--config")) != NULL) && !load_config_file(p_arg))
+   {
+      return EXIT_FAILURE;
+   }
+   {
+      static const char *const storage_args[][2] =
+      {
+         { "--page-size",  "page_size"  },
+         { "--cache-size", "cache_size" },
+         { "--mmap-size",  "mmap_size"  },
+         { "--temp-store", "temp_store" },
+      };
+
+      for (size_t i = 0; i < ARRAY_SIZE(storage_args); i++)
+      {
+         if (((p_arg = arg.Param(storage_args[i][0])) != NULL) &&
+             !storage_set(storage_args[i][1], p_arg))
+         {
+            fprintf(stderr, "Invalid value for %s: %s\n", storage_args[i][0], p_arg);
+            usage_exit(NULL, argv[0], EXIT_FAILURE);
+         }
+      }
+   }
+   if (arg.Present("--exclusive"))
+   {
+      cpd.storage.exclusive = 1;
+   }
+   if (arg.Present("--autotune"))
+   {
+      cpd.storage.autotune = true;
+   }
+   in_memory_build = arg.Present("--in-memory-build");
+   merge_file = arg.Param("--merge");
+   maintain = arg.Present("--maintain");
+   index_stats = arg.Present("--index-stats");
+   reshard = 0;
+   if ((p_arg = arg.Param("--reshard")) != NULL)
+   {
+      reshard = atoi(p_arg);
+      if (reshard < 1)
+      {
+         usage_exit("Expected --reshard n with n of at least 1", argv[0], EXIT_FAILURE);
+      }
+   }
+
+   idx = 0;
+   while ((p_arg = arg.Params("--id", idx)) != NULL)
+   {
+      identifiers.push_back(p_arg);
+   }
+   if ((p_arg = arg.Param("--id-file")) != NULL)
+   {
+      if (!process_id_list(p_arg, identifiers))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   identifier = identifiers.empty() ? NULL : identifiers[0].c_str();
 
-   identifier = arg.Param("--id");
+   at = arg.Param("--at");
+   if (at != NULL)
+   {
+      const char *col_sep = strrchr(at, ':');
+      const char *line_sep = NULL;
+
+      if (col_sep != NULL)
+      {
+         at_file.assign(at, col_sep - at);
+         size_t pos = at_file.rfind(':');
+         if (pos != string::npos)
+         {
+            line_sep = at + pos;
+            at_file.erase(pos);
+         }
+      }
+      if ((line_sep == NULL) || at_file.empty() ||
+          ((at_line = strtoul(line_sep + 1, NULL, 10)) == 0) ||
+          ((at_column = strtoul(col_sep + 1, NULL, 10)) == 0))
+      {
+         usage_exit("Expected --at file:line:column", argv[0], EXIT_FAILURE);
+      }
+   }
+
+   stats = arg.Present("--stats");
+   stats_json = arg.Param("--stats-json");
+   if (stats || (stats_json != NULL))
+   {
+      stats_enable(arg.Present("--stats-per-file"));
+   }
+
+   if ((p_arg = arg.Param("--trace")) != NULL)
+   {
+      trace_enable(p_arg);
+   }
 
    refs = arg.Present("--refs");
    defs = arg.Present("--defs");
    decls = arg.Present("--decls");
    if (!(refs || defs || decls))
    {
-      refs = defs = decls = true;
+      /* Go to definition by default for a position */
+      refs = (at == NULL);
+      defs = decls = true;
+   }
+
+   if ((p_arg = arg.Param("--format")) != NULL)
+   {
+      if (!output_format_from_string(p_arg, cpd.format))
+      {
+         usage_exit("Unknown output format", argv[0], EXIT_FAILURE);
+      }
+   }
+
+   memset(&lookup, 0, sizeof(lookup));
+   lookup.kinds = (refs ? (1U << IST_REFERENCE) : 0) |
+                  (defs ? (1U << IST_DEFINITION) : 0) |
+                  (decls ? (1U << IST_DECLARATION) : 0);
+   lookup.limit = -1;
+   if ((p_arg = arg.Param("--limit")) != NULL)
+   {
+      lookup.limit = atoi(p_arg);
+   }
+   if ((p_arg = arg.Param("--offset")) != NULL)
+   {
+      lookup.offset = atoi(p_arg);
+   }
+   lookup.defs_first = arg.Present("--defs-first");
+   lookup.near = arg.Param("--near");
+   if ((p_arg = arg.Param("--type")) != NULL)
+   {
+      if (!id_types_from_string(p_arg, lookup.types))
+      {
+         usage_exit(NULL, argv[0], EXIT_FAILURE);
+      }
+      if (lookup.types == 0)
+      {
+         lookup.kinds = 0;
+      }
+   }
+   lookup.scope = arg.Param("--scope");
+   lookup.path = arg.Param("--in");
+
+   export_mmap = arg.Param("--export-mmap");
+   mapped_file = arg.Param("--mmap");
+
+   serve_socket = arg.Param("--serve");
+   connect_socket = arg.Param("--connect");
+   readers = 4;
+   if ((p_arg = arg.Param("--readers")) != NULL)
+   {
+      readers = atoi(p_arg);
    }
 
    LOG_FMT(LNOTE, "output_file = %s\n", (output_file != NULL) ? output_file : "null");
@@ -260,59 +739,224 @@ int main(int argc, char *argv[])
    idx   = 1;
    p_arg = arg.Unused(idx);
 
-   if ((source_list != NULL) || (p_arg != NULL) || (identifier != NULL))
+   if ((connect_socket != NULL) && (identifier != NULL))
+   {
+      string request = decls ? "decls" : "";
+      char limit_str[16];
+
+      if (defs)
+      {
+         request += request.empty() ? "defs" : ",defs";
+      }
+      if (refs)
+      {
+         request += request.empty() ? "refs" : ",refs";
+      }
+      if ((lookup.offset > 0) || lookup.defs_first || (lookup.near != NULL) ||
+          (lookup.types != 0) || (lookup.scope != NULL) || (lookup.path != NULL) ||
+          (cpd.format != OF_TEXT))
+      {
+         LOG_FMT(LWARN, "Only --refs, --defs, --decls and --limit are supported with --connect, the matches are printed as text\n");
+      }
+      snprintf(limit_str, sizeof(limit_str), " %d ", (lookup.limit >= 0) ? lookup.limit : 0);
+      request += limit_str;
+
+      for (size_t i = 0; i < identifiers.size(); i++)
+      {
+         if (!client_run(connect_socket, (request + identifiers[i]).c_str()))
+         {
+            return EXIT_FAILURE;
+         }
+      }
+   }
+   else if ((mapped_file != NULL) && (identifier != NULL))
+   {
+      mapped_index *mi = mapped_index_open(mapped_file);
+
+      if (mi == NULL)
+      {
+         return EXIT_FAILURE;
+      }
+      if (lookup.defs_first || (lookup.near != NULL) ||
+          (lookup.scope != NULL) || (lookup.path != NULL))
+      {
+         LOG_FMT(LWARN, "--defs-first, --near, --scope and --in are not supported with --mmap\n");
+      }
+      for (size_t i = 0; (i < identifiers.size()) && (lookup.limit != 0); i++)
+      {
+         (void) mapped_index_lookup(mi, identifiers[i].c_str(), lookup);
+      }
+      output_flush();
+      mapped_index_close(mi);
+   }
+   else if (merge_file != NULL)
+   {
+      deque<string> inputs;
+
+      idx = 1;
+      while ((p_arg = arg.Unused(idx)) != NULL)
+      {
+         inputs.push_back(p_arg);
+      }
+      if (inputs.empty())
+      {
+         usage_exit("Expected --merge <out> <index> ...", argv[0], EXIT_FAILURE);
+      }
+      if (cpd.storage.autotune)
+      {
+         index_autotune(merge_file, true);
+      }
+      if (!index_merge(merge_file, inputs))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   else if (reshard > 0)
+   {
+      if (cpd.storage.autotune)
+      {
+         index_autotune(index_file, true);
+      }
+      if (!index_reshard(index_file, reshard))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+   else if (maintain || index_stats)
+   {
+      if (!index_open(index_file, false))
+      {
+         return EXIT_FAILURE;
+      }
+      if (maintain && !index_maintain())
+      {
+         index_close();
+         return EXIT_FAILURE;
+      }
+      index_report(index_file, stdout);
+      index_close();
+   }
+   else if (serve_socket != NULL)
+   {
+      if (cpd.storage.autotune)
+      {
+         index_autotune(index_file, false);
+      }
+      if (!index_open(index_file, false))
+      {
+         return EXIT_FAILURE;
+      }
+      if (!server_run(index_file, serve_socket, readers))
+      {
+         index_close();
+         return EXIT_FAILURE;
+      }
+      index_close();
+   }
+   else if ((source_list != NULL) || (p_arg != NULL) || !crawl_roots.empty() ||
+            (identifier != NULL) || (at != NULL) || (export_mmap != NULL))
    {
       deque<string> source_files;
+      bool analyze = (source_list != NULL) || (p_arg != NULL) || !crawl_roots.empty();
+
+      if (in_memory_build && watch)
+      {
+         LOG_FMT(LWARN, "--in-memory-build is not supported with --watch\n");
+      }
+      cpd.in_memory = in_memory_build && analyze && !watch;
 
-      if (!index_open(index_file, (source_list != NULL) || (p_arg != NULL)))
+      /* Lookups must not be locked out while watching */
+      if (watch && (cpd.storage.exclusive > 0))
+      {
+         LOG_FMT(LWARN, "--exclusive is not supported with --watch\n");
+      }
+      if (watch)
+      {
+         cpd.storage.exclusive = 0;
+      }
+      if (cpd.storage.autotune)
+      {
+         index_autotune(index_file, analyze && !watch);
+      }
+
+      if (!index_open(index_file, analyze))
       {
          return EXIT_FAILURE;
       }
 
-      if ((source_list != NULL) || (p_arg != NULL))
+      if (analyze)
       {
-         if (index_prepare_for_analysis() && index_prune_files())
+         if (watch && index_prepare_for_analysis() && (!prune || index_prune_files()))
          {
-            /* Build a list of source files */
-            if (p_arg != NULL)
+            /* The arguments are directories to watch */
+            idx = 1;
+            while ((p_arg = arg.Unused(idx)) != NULL)
             {
-               idx = 1;
-               while ((p_arg = arg.Unused(idx)) != NULL)
-               {
-                  source_files.push_back(p_arg);
-               }
+               source_files.push_back(p_arg);
             }
-            if (source_list != NULL)
+            (void) watch_run(source_files, debounce, dump);
+            index_end_analysis();
+         }
+         else if (!watch && index_prepare_for_analysis() && (!prune || index_prune_files()))
+         {
+            idx = 1;
+            while ((p_arg = arg.Unused(idx)) != NULL)
             {
-               (void) process_source_list(source_list, source_files);
+               do_source_file(p_arg, dump);
             }
 
-            size_t size = source_files.size();
-
-            for (size_t i = 0; i < size; i += 1)
+            /* The files are analyzed as they are read or found */
+            if (source_list != NULL)
             {
-               const char *fn = source_files.at(i).c_str();
-               do_source_file(fn, dump);
+               (void) process_source_list(source_list, list_delim, dump);
+            }
+            if (!crawl_roots.empty())
+            {
+               string fn;
+
+               crawl_start(crawl_roots, excludes, cpd.threads);
+               while (crawl_next(fn))
+               {
+                  do_source_file(fn.c_str(), dump);
+               }
+               crawl_finish();
             }
 
             index_end_analysis();
+            if (!index_save())
+            {
+               index_close();
+               return EXIT_FAILURE;
+            }
          }
+
+         write_stats(stats, stats_json);
+         (void) trace_write();
+      }
+
+      if ((export_mmap != NULL) && !mapped_index_export(export_mmap))
+      {
+         index_close();
+         return EXIT_FAILURE;
       }
 
       if (identifier != NULL)
       {
-         if (decls)
-         {
-            (void) index_lookup_identifier(identifier, IST_DECLARATION);
-         }
-         if (defs)
+         if (identifiers.size() == 1)
          {
-            (void) index_lookup_identifier(identifier, IST_DEFINITION);
+            (void) index_lookup_identifier(identifier, lookup);
          }
-         if (refs)
+         else
          {
-            (void) index_lookup_identifier(identifier, IST_REFERENCE);
+            (void) index_lookup_identifiers(identifiers, lookup);
          }
+         output_flush();
+      }
+
+      if (at != NULL)
+      {
+         (void) index_lookup_position(at_file.c_str(), at_line, at_column, lookup);
+         output_flush();
       }
 
       index_close();
@@ -329,7 +973,49 @@ int main(int argc, char *argv[])
 }
 
 
-static bool process_source_list(const char *source_list, deque<string>& source_files)
+static void write_stats(bool text, const char *json_file)
+{
+   FILE *p_json = NULL;
+
+   if (json_file != NULL)
+   {
+      p_json = (strcmp(json_file, "-") == 0) ? stdout : fopen(json_file, "w");
+      if (p_json == NULL)
+      {
+         LOG_FMT(LERR, "%s: fopen(%s) failed: %s (%d)\n",
+                 __func__, json_file, strerror(errno), errno);
+      }
+   }
+
+   stats_report(text ? stderr : NULL, p_json);
+
+   if ((p_json != NULL) && (p_json != stdout))
+   {
+      fclose(p_json);
+   }
+}
+
+
+/**
+ * Reads an item, such as a line, of any length from a file.
+ * Returns false at the end of the file.
+ *
+ * @param delim  The character that ends an item, it is not included
+ */
+bool read_list_item(FILE *p_file, string& item, int delim)
+{
+   int ch;
+
+   item.clear();
+   while (((ch = getc(p_file)) != EOF) && (ch != delim))
+   {
+      item += (char) ch;
+   }
+   return (ch != EOF) || !item.empty();
+}
+
+
+static bool process_source_list(const char *source_list, int delim, bool dump)
 {
    int from_stdin = strcmp(source_list, "-") == 0;
    FILE *p_file = from_stdin ? stdin : fopen(source_list, "r");
@@ -341,32 +1027,67 @@ static bool process_source_list(const char *source_list, deque<string>& source_f
       return false;
    }
 
-   char linebuf[256];
-   char *fname;
-   int  line = 0;
-   int  len;
+   string fname;
+   int    line = 0;
 
-   while (fgets(linebuf, sizeof(linebuf), p_file) != NULL)
+   while (read_list_item(p_file, fname, delim))
    {
       line++;
-      fname = linebuf;
-      len   = strlen(fname);
-      while ((len > 0) && isspace((unsigned char) *fname))
+
+      /* Filenames separated by NUL are taken as is */
+      if (delim != 0)
       {
-         fname++;
-         len--;
+         size_t start = 0, end = fname.size();
+
+         while ((start < end) && isspace((unsigned char) fname[start]))
+         {
+            start++;
+         }
+         while ((end > start) && isspace((unsigned char) fname[end - 1]))
+         {
+            end--;
+         }
+         fname = fname.substr(start, end - start);
       }
-      while ((len > 0) && isspace((unsigned char) fname[len - 1]))
+
+      LOG_FMT(LFILELIST, "%3d] %s\n", line, fname.c_str());
+
+      if (!fname.empty() && ((delim == 0) || (fname[0] != '#')))
       {
-         len--;
+         do_source_file(fname.c_str(), dump);
       }
-      fname[len] = 0;
+   }
+
+   if (!from_stdin)
+   {
+      fclose(p_file);
+   }
+
+   return true;
+}
+
 
-      LOG_FMT(LFILELIST, "%3d] %s\n", line, fname);
+static bool process_id_list(const char *id_list, deque<string>& identifiers)
+{
+   int from_stdin = strcmp(id_list, "-") == 0;
+   FILE *p_file = from_stdin ? stdin : fopen(id_list, "r");
+   string name;
+
+   if (p_file == NULL)
+   {
+      LOG_FMT(LERR, "%s: fopen(%s) failed: %s (%d)\n",
+              __func__, id_list, strerror(errno), errno);
+      return false;
+   }
 
-      if (fname[0] != '#')
+   while (read_list_item(p_file, name, '\n'))
+   {
+      size_t start = name.find_first_not_of(" \t\r");
+      size_t end = name.find_last_not_of(" \t\r");
+
+      if (start != string::npos)
       {
-         source_files.push_back(fname);
+         identifiers.push_back(name.substr(start, end - start + 1));
       }
    }
 
@@ -384,28 +1105,57 @@ static bool process_source_list(const char *source_list, deque<string>& source_f
  *
  * @param filename the file to read
  */
-static void do_source_file(const char *filename, bool dump)
+void do_source_file(const char *filename, bool dump)
 {
    fp_data fpd;
 
+   if (!index_in_partition(filename))
+   {
+      LOG_FMT(LFILELIST, "Skipped %s, not in partition %u/%u\n", filename, cpd.partition, cpd.partitions);
+      return;
+   }
+
    fpd.filename = filename;
    fpd.frame_count = 0;
    fpd.frame_pp_level = 0;
+   fpd.mode = cpd.mode;
+   fpd.degraded = DR_NONE;
+   fpd.deadline = 0;
+   fpd.budget_checks = 0;
+   fpd.filerow = 0;
+   fpd.delta = false;
 
    /* Do some simple language detection based on the filename extension */
    fpd.lang_flags = cpd.forced_lang_flags != LANG_NONE ?
       cpd.forced_lang_flags : language_from_filename(filename);
 
+   stats_begin_file(filename);
+   trace_begin("do_source_file", filename);
+
    /* Read in the source file */
+   stats_phase_begin(SP_DECODE);
    if (!decode_file(fpd.data, filename))
    {
+      stats_phase_end(SP_DECODE);
+      stats_end_file(-1);
+      trace_end("do_source_file");
       return;
    }
+   stats_phase_end(SP_DECODE);
+   stats_add_bytes(fpd.data.size());
+
+   check_file_limits(fpd);
 
    /* Calculate MD5 digest */
+   stats_phase_begin(SP_MD5);
    MD5::Calc(&fpd.data[0], fpd.data.size(), fpd.digest);
+   stats_phase_end(SP_MD5);
 
-   if (index_prepare_for_file(fpd))
+   stats_phase_begin(SP_INDEX_LOOKUP_FILE);
+   bool analyze = index_prepare_for_file(fpd);
+   stats_phase_end(SP_INDEX_LOOKUP_FILE);
+
+   if (analyze)
    {
       LOG_FMT(LNOTE, "Parsing: %s as language %s\n",
               filename, language_to_string(fpd.lang_flags));
@@ -420,21 +1170,39 @@ static void do_source_file(const char *filename, bool dump)
 
       index_begin_file(fpd);
 
+      stats_phase_begin(SP_OUTPUT);
       output(fpd);
+      stats_phase_end(SP_OUTPUT);
 
       index_end_file(fpd);
 
       toks_end(fpd);
+      stats_add_degraded(fpd.degraded);
    }
+
+   stats_end_file(analyze ? 1 : 0);
+   trace_end("do_source_file");
 }
 
 
 static void toks_start(fp_data& fpd)
 {
+   if (cpd.max_parse_time > 0)
+   {
+      fpd.deadline = wall_clock() + cpd.max_parse_time;
+   }
+
    /**
     * Parse the text into chunks
     */
+   stats_phase_begin(SP_TOKENIZE);
    tokenize(fpd);
+   stats_phase_end(SP_TOKENIZE);
+
+   if (cpd.max_tokens > 0)
+   {
+      check_token_limit(fpd);
+   }
 
    /**
     * Change certain token types based on simple sequence.
@@ -442,13 +1210,17 @@ static void toks_start(fp_data& fpd)
     * Note that level info is not yet available, so it is OK to do all
     * processing that doesn't need to know level info. (that's very little!)
     */
+   stats_phase_begin(SP_TOKENIZE_CLEANUP);
    tokenize_cleanup(fpd);
+   stats_phase_end(SP_TOKENIZE_CLEANUP);
 
    /**
     * Detect the brace and paren levels and insert virtual braces.
     * This handles all that nasty preprocessor stuff
     */
+   stats_phase_begin(SP_BRACE_CLEANUP);
    brace_cleanup(fpd);
+   stats_phase_end(SP_BRACE_CLEANUP);
 
    /**
     * At this point, the level information is available and accurate.
@@ -462,17 +1234,116 @@ static void toks_start(fp_data& fpd)
    /**
     * Re-type chunks, combine chunks
     */
+   stats_phase_begin(SP_FIX_SYMBOLS);
    fix_symbols(fpd);
+   stats_phase_end(SP_FIX_SYMBOLS);
+
+   /* Types and scopes are not needed if parsing was abandoned */
+   if (fpd.mode == PM_IDENTIFIERS)
+   {
+      return;
+   }
 
    /**
     * Look at all colons ':' and mark labels, :? sequences, etc.
     */
+   stats_phase_begin(SP_COMBINE_LABELS);
    combine_labels(fpd);
+   stats_phase_end(SP_COMBINE_LABELS);
 
    /**
     * Assign scope information
     */
+   stats_phase_begin(SP_ASSIGN_SCOPE);
    assign_scope(fpd);
+   stats_phase_end(SP_ASSIGN_SCOPE);
+}
+
+
+/**
+ * Degrades the analysis of files that exceed the size or line length limits,
+ * before the parsing starts.
+ */
+static void check_file_limits(fp_data& fpd)
+{
+   if ((cpd.max_file_size > 0) && (fpd.data.size() > cpd.max_file_size))
+   {
+      fpd.degraded |= DR_FILE_SIZE;
+   }
+
+   if (cpd.max_line_length > 0)
+   {
+      UINT32 len = 0;
+
+      for (size_t i = 0; i < fpd.data.size(); i++)
+      {
+         if (fpd.data[i] == '\n')
+         {
+            len = 0;
+         }
+         else if (++len > cpd.max_line_length)
+         {
+            fpd.degraded |= DR_LINE_LENGTH;
+            break;
+         }
+      }
+   }
+
+   if (fpd.degraded != DR_NONE)
+   {
+      LOG_FMT(LWARN, "%s: exceeds file limits, only indexing definitions/declarations\n",
+              fpd.filename);
+      fpd.mode = PM_DECLS_ONLY;
+   }
+}
+
+
+static void check_token_limit(fp_data& fpd)
+{
+   chunk_t *pc;
+   UINT32 tokens = 0;
+
+   for (pc = chunk_get_head(fpd); pc != NULL; pc = chunk_get_next(pc))
+   {
+      if (++tokens > cpd.max_tokens)
+      {
+         LOG_FMT(LWARN, "%s: more than %u tokens, only indexing definitions/declarations\n",
+                 fpd.filename, cpd.max_tokens);
+         fpd.degraded |= DR_TOKENS;
+         if (fpd.mode == PM_FULL)
+         {
+            fpd.mode = PM_DECLS_ONLY;
+         }
+         break;
+      }
+   }
+}
+
+
+/**
+ * Checks the parse time budget of a file, for use in loops that can take a
+ * long time on pathological input. Once the budget is exceeded the file is
+ * degraded to PM_IDENTIFIERS and the caller should stop its work.
+ * The clock is only read every 256 calls.
+ */
+bool parse_time_exceeded(fp_data& fpd)
+{
+   if (fpd.mode == PM_IDENTIFIERS)
+   {
+      return(true);
+   }
+
+   if ((fpd.deadline == 0) || ((++fpd.budget_checks & 0xff) != 0) ||
+       (wall_clock() < fpd.deadline))
+   {
+      return(false);
+   }
+
+   LOG_FMT(LWARN, "%s: exceeds parse time limit, only indexing identifiers\n",
+           fpd.filename);
+   fpd.mode = PM_IDENTIFIERS;
+   fpd.degraded |= DR_PARSE_TIME;
+   return(true);
 }
 
 
@@ -480,11 +1351,15 @@ static void toks_end(fp_data& fpd)
 {
    /* Free all the memory */
    chunk_t *pc;
+   UINT64 tokens = 0;
 
    while ((pc = chunk_get_head(fpd)) != NULL)
    {
       chunk_del(fpd, pc);
+      tokens++;
    }
+
+   stats_add_tokens(tokens);
 }
 
 
@@ -586,6 +1461,24 @@ const char *get_file_extension(int& idx)
 }
 
 
+/**
+ * Checks if the file extension is one of the known source file extensions
+ */
+bool is_source_filename(const char *filename)
+{
+   int i;
+
+   for (i = 0; i < (int)ARRAY_SIZE(languages); i++)
+   {
+      if (ends_with(filename, languages[i].ext))
+      {
+         return(true);
+      }
+   }
+   return(false);
+}
+
+
 /**
  * Find the language for the file extension
  * Default to C
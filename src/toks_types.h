@@ -298,6 +298,62 @@ struct lookup_entry_t
    const chunk_tag_t *tag;
 };
 
+/**
+ * How much of a file is analyzed, recorded per file in the index
+ */
+typedef enum
+{
+   PM_FULL,              // all identifiers
+   PM_DECLS_ONLY,        // definitions/declarations outside function bodies
+   PM_IDENTIFIERS,       // identifiers only, without types or scopes
+} parse_mode;
+
+/**
+ * Reasons for analyzing a file in a degraded mode, recorded per file in the
+ * index
+ */
+enum
+{
+   DR_NONE        = 0x00,
+   DR_FILE_SIZE   = 0x01,   // file larger than --max-file-size
+   DR_LINE_LENGTH = 0x02,   // line longer than --max-line-length
+   DR_TOKENS      = 0x04,   // more tokens than --max-tokens
+   DR_PARSE_TIME  = 0x08,   // parsing took longer than --max-parse-time
+};
+
+/**
+ * Phases timed by --stats
+ */
+enum stats_phase
+{
+   SP_DECODE,
+   SP_MD5,
+   SP_TOKENIZE,
+   SP_TOKENIZE_CLEANUP,
+   SP_BRACE_CLEANUP,
+   SP_FIX_SYMBOLS,
+   SP_COMBINE_LABELS,
+   SP_ASSIGN_SCOPE,
+   SP_OUTPUT,
+   SP_INDEX_LOOKUP_FILE,
+   SP_INDEX_INSERT,      // nested in SP_OUTPUT
+   SP_INDEX_COMMIT,
+   SP_INDEX_PRUNE,
+   SP_COUNT
+};
+
+/* An entry of a file in the index, see index_apply_delta() */
+struct index_entry
+{
+   sqlite3_int64      rowid;      // in the table of the sub type, 0 if new
+   UINT32             line;
+   UINT32             column;
+   int                type;       // id_type
+   int                sub_type;   // id_sub_type
+   string             scope;
+   string             identifier;
+};
+
 struct fp_data
 {
    const char         *filename;
@@ -309,14 +365,39 @@ struct fp_data
    int                frame_pp_level;
 
    int                lang_flags; // LANG_xxx
+   parse_mode         mode;
+   int                degraded;   // DR_xxx
+   double             deadline;   // wall_clock() limit for parsing, 0 = none
+   UINT32             budget_checks;
+   sqlite3_int64      filerow;
+   bool               delta;      // the file is in the index, its entries are
+   vector<index_entry> entries;   // collected and diffed with the old ones
 
    ListManager<chunk_t> chunk_list;
 };
 
-struct cp_data
+/* Formats of lookup results */
+typedef enum
+{
+   OF_TEXT,
+   OF_JSON,
+   OF_NUL,
+} output_format;
+
+/* The cached lookup statements, one for each combination of the kinds and
+ * the options that change the query */
+#define LOOKUP_STATEMENTS 256
+
+/* A connection to an index database, one for each shard of the index */
+struct index_db
 {
-   int                forced_lang_flags; // LANG_xxx
    sqlite3            *index;
+   bool               wal;               // journal_mode=WAL
+   int                group_files;       // files in the open transaction with WAL
+   string             file;              // the file of a shard opened in memory
+   bool               file_wal;          // the file was in journal_mode=WAL
+   sqlite3            *file_lock;        // holds the file locked until saved
+   bool               bulk;              // filled from empty, no lookup indexes
 
    sqlite3_stmt       *stmt_insert_reference;
    sqlite3_stmt       *stmt_insert_definition;
@@ -331,6 +412,51 @@ struct cp_data
    sqlite3_stmt       *stmt_prune_decls;
    sqlite3_stmt       *stmt_change_digest;
    sqlite3_stmt       *stmt_lookup_file;
+   sqlite3_stmt       *stmt_degrade_file;
+   sqlite3_stmt       *stmt_file_entries;
+   sqlite3_stmt       *stmt_delete_entry[3];           // by id_sub_type
+   sqlite3_stmt       *stmt_move_entry[3];
+   sqlite3_stmt       *stmt_move_entries[3];           // of a file to another row
+   sqlite3_stmt       *stmt_find_content;
+   sqlite3_stmt       *stmt_cache_file;
+   sqlite3_stmt       *stmt_uncache_file;
+   sqlite3_stmt       *stmt_lookup[LOOKUP_STATEMENTS]; // see lookup_statement()
+};
+
+/* SQLite storage parameters of the index, -1 for the SQLite default */
+struct storage_options
+{
+   int                page_size;         // bytes, when the index is created
+   int64_t            cache_size;        // KiB for each shard
+   int64_t            mmap_size;         // bytes for each shard
+   int                temp_store;        // 0 = default, 1 = file, 2 = memory
+   int                exclusive;         // locking_mode=EXCLUSIVE while indexing
+   bool               autotune;          // chosen by index_autotune()
+};
+
+struct cp_data
+{
+   int                forced_lang_flags; // LANG_xxx
+   parse_mode         mode;
+   UINT32             ref_types;         // (1 << id_type) of references to index
+   UINT32             func_ref_types;    // same, for references inside functions
+   bool               ref_types_set;     // given on the command line
+   UINT64             max_file_size;     // limits for full analysis, 0 = none
+   UINT32             max_line_length;
+   UINT32             max_tokens;
+   double             max_parse_time;    // seconds
+   bool               batch;             // in index_begin_batch()
+   int                threads;           // for directory crawling and pruning
+   output_format      format;            // of lookup results
+   int                shard_count;       // shards of a new index, 0 = single file
+   bool               wal;               // switch the index to journal_mode=WAL
+   bool               in_memory;         // build in memory, see index_save()
+   int                parse_cache;       // contents kept for files that are gone
+   UINT32             partition;         // the files to index with --shard i/N,
+   UINT32             partitions;        // those with partition i of N, 0 = all
+   storage_options    storage;
+   vector<index_db *> shards;            // the shards of the open index
+   index_db           *db;               // the shard of the file being indexed
 };
 
 extern struct cp_data cpd;
@@ -362,4 +488,30 @@ typedef enum
    IST_DECLARATION,
 } id_sub_type;
 
+#define IST_ALL_BITS ((1U << IST_REFERENCE) | (1U << IST_DEFINITION) | (1U << IST_DECLARATION))
+
+/* What to look up and how to order the matches */
+struct lookup_options
+{
+   UINT32     kinds;        // (1 << id_sub_type) of the entries to look up
+   int        limit;        // maximum number of matches, negative for no limit
+   int        offset;       // number of matches to skip
+   bool       defs_first;   // definitions, then declarations, then references
+   const char *near;        // order by distance from this file, or NULL
+   UINT32     types;        // (1 << id_type) of the entries to look up, 0 for all
+   const char *scope;       // scope pattern the entries must match, or NULL
+   const char *path;        // path prefix of the files to look in, or NULL
+   const char *context_scope; // order by how well the scope matches this, or NULL
+};
+
+/* Read-only connections to the shards of the index with their own lookup
+ * statements */
+struct index_reader
+{
+   vector<index_db *> shards;
+};
+
+/* A read-only binary index in a memory mapping, see mapped_index.cpp */
+struct mapped_index;
+
 #endif   /* TOKS_TYPES_H_INCLUDED */
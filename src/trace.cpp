@@ -0,0 +1,194 @@
+/**
+ * @file trace.cpp
+ * Records begin/end spans and writes them in the Chrome trace event
+ * format, which can be loaded in about:tracing or Perfetto.
+ *
+ * Each thread appends to its own buffer, so recording a span takes no
+ * locks. A new buffer is pushed onto a list with compare-and-swap, and the
+ * buffers are only merged when the trace is written. With --watch they are
+ * written and cleared after each update, and the end of the file is kept
+ * complete, so the trace stays readable if the process is killed.
+ *
+ * @author  Thomas Thorsen
+ * @license GPL v2+
+ */
+#include "toks_types.h"
+#include "prototypes.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
+
+struct trace_event
+{
+   const char *name;     /* static string */
+   char       phase;     /* 'B' or 'E' */
+   UINT64     ts;        /* nanoseconds since trace_enable() */
+   string     arg;
+};
+
+struct trace_buffer
+{
+   trace_buffer        *next;
+   int                 tid;
+   vector<trace_event> events;
+};
+
+static bool                  trace_on;
+static const char            *trace_filename;
+static UINT64                trace_start;
+static int                   trace_threads;
+static trace_buffer          *trace_buffers;
+static FILE                  *trace_file;
+static bool                  trace_first = true;
+static __thread trace_buffer *thread_buffer;
+
+
+static UINT64 trace_now(void)
+{
+#ifdef WIN32
+   return (UINT64) clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (UINT64) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static trace_buffer *get_thread_buffer(void)
+{
+   if (thread_buffer == NULL)
+   {
+      trace_buffer *buf = new trace_buffer;
+
+      buf->tid = __sync_add_and_fetch(&trace_threads, 1);
+      buf->events.reserve(4096);
+      do
+      {
+         buf->next = trace_buffers;
+      } while (!__sync_bool_compare_and_swap(&trace_buffers, buf->next, buf));
+
+      thread_buffer = buf;
+   }
+   return thread_buffer;
+}
+
+static void trace_add(const char *name, char phase, const char *arg)
+{
+   trace_buffer *buf = get_thread_buffer();
+
+   buf->events.push_back(trace_event());
+   trace_event& ev = buf->events.back();
+   ev.name = name;
+   ev.phase = phase;
+   ev.ts = trace_now() - trace_start;
+   if (arg != NULL)
+   {
+      ev.arg = arg;
+   }
+}
+
+
+void trace_enable(const char *filename)
+{
+   trace_on = true;
+   trace_filename = filename;
+   trace_start = trace_now();
+}
+
+void trace_begin(const char *name, const char *arg)
+{
+   if (trace_on)
+   {
+      trace_add(name, 'B', arg);
+   }
+}
+
+void trace_end(const char *name)
+{
+   if (trace_on)
+   {
+      trace_add(name, 'E', NULL);
+   }
+}
+
+/**
+ * Appends the spans recorded since the last call to the trace file and
+ * clears the buffers. The file is opened by the first call, and the end of
+ * its event list is written after the spans and then overwritten by the
+ * next call. Must be called when no other threads are recording.
+ */
+bool trace_flush(void)
+{
+   long tail;
+
+   if (!trace_on)
+   {
+      return true;
+   }
+
+   if (trace_file == NULL)
+   {
+      trace_file = fopen(trace_filename, "w");
+      if (trace_file == NULL)
+      {
+         LOG_FMT(LERR, "%s: fopen(%s) failed: %s (%d)\n",
+                 __func__, trace_filename, strerror(errno), errno);
+         trace_on = false;
+         return false;
+      }
+      fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+   }
+
+   for (trace_buffer *buf = trace_buffers; buf != NULL; buf = buf->next)
+   {
+      for (size_t i = 0; i < buf->events.size(); i++)
+      {
+         const trace_event& ev = buf->events[i];
+
+         fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d",
+                 trace_first ? "" : ",\n", ev.name, ev.phase, ev.ts / 1000.0, buf->tid);
+         if (!ev.arg.empty())
+         {
+            fprintf(trace_file, ",\"args\":{\"file\":");
+            json_string(trace_file, ev.arg.c_str());
+            fprintf(trace_file, "}");
+         }
+         fprintf(trace_file, "}");
+         trace_first = false;
+      }
+      buf->events.clear();
+   }
+
+   tail = ftell(trace_file);
+   fprintf(trace_file, "\n]}\n");
+   (void) fflush(trace_file);
+   (void) fseek(trace_file, tail, SEEK_SET);
+
+   return !ferror(trace_file);
+}
+
+/**
+ * Writes the recorded spans to the trace file and closes it.
+ * Must be called when no other threads are recording.
+ */
+bool trace_write(void)
+{
+   bool retval = trace_flush();
+
+   if (trace_file != NULL)
+   {
+      (void) fseek(trace_file, 0, SEEK_END);
+      if (fclose(trace_file) != 0)
+      {
+         retval = false;
+      }
+      trace_file = NULL;
+   }
+   trace_on = false;
+
+   return retval;
+}
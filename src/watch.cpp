@@ -0,0 +1,327 @@
+/**
+ * @file watch.cpp
+ * Keeps the index up to date with the source files in a set of directories
+ * by watching them with inotify.
+ *
+ * Events are collected until there has been no new event for the debounce
+ * time (or for at most MAX_DELAY_FACTOR times that), so a burst of changes
+ * such as a checkout is handled as one batch in a single transaction.
+ *
+ * @author  Thomas Thorsen
+ * @license GPL v2+
+ */
+#include "toks_types.h"
+#include "prototypes.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <deque>
+#include <set>
+#include <map>
+
+#ifdef __linux__
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define WATCH_EVENTS       (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                            IN_DELETE | IN_CREATE | IN_DELETE_SELF)
+#define MAX_DELAY_FACTOR   10
+#define MAX_BATCH_FILES    256
+
+struct watch_state
+{
+   int                 fd;
+   bool                dump;
+   map<int, string>    dirs;      /* watch descriptor -> directory */
+   set<string>         changed;
+   set<string>         removed;
+   bool                prune;     /* a directory disappeared */
+};
+
+static watch_state watch;
+static volatile sig_atomic_t watch_stop;
+
+
+static void watch_signal(int sig)
+{
+   watch_stop = 1;
+}
+
+static string join_path(const string& dir, const char *name)
+{
+   if (!dir.empty() && (dir[dir.size() - 1] == '/'))
+   {
+      return dir + name;
+   }
+   return dir + "/" + name;
+}
+
+/**
+ * Adds a watch on a directory and its subdirectories, and adds the source
+ * files in them to the changed set.
+ */
+static void watch_tree(const string& dir)
+{
+   DIR *p_dir;
+   struct dirent *ent;
+   int wd;
+
+   wd = inotify_add_watch(watch.fd, dir.c_str(), WATCH_EVENTS | IN_ONLYDIR);
+   if (wd < 0)
+   {
+      LOG_FMT(LWARN, "%s: inotify_add_watch(%s) failed: %s (%d)\n",
+              __func__, dir.c_str(), strerror(errno), errno);
+      return;
+   }
+   watch.dirs[wd] = dir;
+
+   p_dir = opendir(dir.c_str());
+   if (p_dir == NULL)
+   {
+      return;
+   }
+
+   while ((ent = readdir(p_dir)) != NULL)
+   {
+      string path;
+      bool is_dir;
+
+      if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0))
+      {
+         continue;
+      }
+      path = join_path(dir, ent->d_name);
+
+      if (ent->d_type == DT_UNKNOWN)
+      {
+         struct stat st;
+         is_dir = (lstat(path.c_str(), &st) == 0) && S_ISDIR(st.st_mode);
+      }
+      else
+      {
+         is_dir = (ent->d_type == DT_DIR);
+      }
+
+      if (is_dir)
+      {
+         watch_tree(path);
+      }
+      else if (is_source_filename(ent->d_name))
+      {
+         watch.changed.insert(path);
+      }
+   }
+   closedir(p_dir);
+}
+
+static void watch_event(const struct inotify_event *ev)
+{
+   map<int, string>::iterator it = watch.dirs.find(ev->wd);
+
+   if (ev->mask & IN_Q_OVERFLOW)
+   {
+      /* Events were lost, start over */
+      LOG_FMT(LWARN, "inotify queue overflow, rescanning\n");
+      map<int, string> dirs;
+      dirs.swap(watch.dirs);
+      for (it = dirs.begin(); it != dirs.end(); ++it)
+      {
+         (void) inotify_rm_watch(watch.fd, it->first);
+      }
+      for (it = dirs.begin(); it != dirs.end(); ++it)
+      {
+         watch_tree(it->second);
+      }
+      watch.prune = true;
+      return;
+   }
+
+   if (it == watch.dirs.end())
+   {
+      return;
+   }
+
+   if (ev->mask & IN_IGNORED)
+   {
+      watch.dirs.erase(it);
+      return;
+   }
+   if (ev->mask & IN_DELETE_SELF)
+   {
+      watch.prune = true;
+      return;
+   }
+   if (ev->len == 0)
+   {
+      return;
+   }
+
+   string path = join_path(it->second, ev->name);
+
+   if (ev->mask & IN_ISDIR)
+   {
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+      {
+         watch_tree(path);
+      }
+      else if (ev->mask & IN_MOVED_FROM)
+      {
+         watch.prune = true;
+      }
+   }
+   else if (is_source_filename(ev->name))
+   {
+      if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+      {
+         watch.removed.erase(path);
+         watch.changed.insert(path);
+      }
+      else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+      {
+         watch.changed.erase(path);
+         watch.removed.insert(path);
+      }
+   }
+}
+
+/* Updates the index with the collected changes */
+static void watch_flush(void)
+{
+   size_t count = 0;
+
+   if (watch.changed.empty() && watch.removed.empty() && !watch.prune)
+   {
+      return;
+   }
+
+   LOG_FMT(LNOTE, "Updating index: %d changed, %d removed files\n",
+           (int) watch.changed.size(), (int) watch.removed.size());
+
+   index_begin_batch();
+   for (set<string>::iterator it = watch.removed.begin(); it != watch.removed.end(); ++it)
+   {
+      (void) index_remove_filename(it->c_str());
+   }
+   if (watch.prune)
+   {
+      (void) index_prune_files();
+   }
+   for (set<string>::iterator it = watch.changed.begin(); it != watch.changed.end(); ++it)
+   {
+      if (++count % MAX_BATCH_FILES == 0)
+      {
+         index_end_batch();
+         index_begin_batch();
+      }
+      do_source_file(it->c_str(), watch.dump);
+   }
+   (void) index_trim_cache();
+   index_end_batch();
+   (void) trace_flush();
+
+   watch.changed.clear();
+   watch.removed.clear();
+   watch.prune = false;
+}
+
+
+/**
+ * Indexes the source files in the directories and keeps the index up to
+ * date until SIGINT or SIGTERM. The index must be prepared for analysis.
+ *
+ * @param dirs         The directories to watch, recursively
+ * @param debounce_ms  The time without events before updating the index
+ */
+bool watch_run(const deque<string>& dirs, int debounce_ms, bool dump)
+{
+   struct sigaction sa;
+   double first_event = 0;
+   char buffer[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+   watch.fd = inotify_init1(IN_CLOEXEC);
+   if (watch.fd < 0)
+   {
+      LOG_FMT(LERR, "%s: inotify_init1() failed: %s (%d)\n", __func__, strerror(errno), errno);
+      return false;
+   }
+   watch.dump = dump;
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = watch_signal;
+   sigemptyset(&sa.sa_mask);
+   (void) sigaction(SIGINT, &sa, NULL);
+   (void) sigaction(SIGTERM, &sa, NULL);
+
+   /* The watches are added before the initial pass, so no change is missed */
+   for (size_t i = 0; i < dirs.size(); i++)
+   {
+      watch_tree(dirs[i]);
+   }
+   watch_flush();
+   (void) index_create_lookup_indexes();
+   LOG_FMT(LNOTE, "Watching %d directories\n", (int) watch.dirs.size());
+
+   while (!watch_stop)
+   {
+      struct pollfd pfd = { watch.fd, POLLIN, 0 };
+      bool pending = !watch.changed.empty() || !watch.removed.empty() || watch.prune;
+      int result = poll(&pfd, 1, pending ? debounce_ms : -1);
+
+      if (result < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         LOG_FMT(LERR, "%s: poll() failed: %s (%d)\n", __func__, strerror(errno), errno);
+         break;
+      }
+
+      if (result > 0)
+      {
+         ssize_t len = read(watch.fd, buffer, sizeof(buffer));
+
+         for (char *p = buffer; (len > 0) && (p < buffer + len); )
+         {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+
+            watch_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+         }
+
+         if (!pending)
+         {
+            first_event = wall_clock();
+         }
+
+         /* Don't let a continuous stream of events delay the update forever */
+         if (wall_clock() - first_event < MAX_DELAY_FACTOR * debounce_ms / 1000.0)
+         {
+            continue;
+         }
+      }
+
+      watch_flush();
+   }
+
+   watch_flush();
+   close(watch.fd);
+
+   return true;
+}
+
+#else /* !__linux__ */
+
+bool watch_run(const deque<string>& dirs, int debounce_ms, bool dump)
+{
+   LOG_FMT(LERR, "%s: not supported on this platform\n", __func__);
+   return false;
+}
+
+#endif